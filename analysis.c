@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <analysis.h>
+
+/*
+ * Generic vectors are lowered to NEON or SSE by the compiler, with blocks of
+ * 16 luma samples as the processing unit.
+ */
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+typedef int16_t v16s16 __attribute__((vector_size(32)));
+typedef uint32_t v16u32 __attribute__((vector_size(64)));
+
+#define ANALYSIS_BLOCK		16
+
+/* Histogram delta in per-mille of samples moving to other bins. */
+#define ANALYSIS_CUT_HISTOGRAM		250
+#define ANALYSIS_CUT_HISTOGRAM_ALONE	500
+#define ANALYSIS_CUT_SAD_MIN		16
+
+/* Variance of a block of samples, scaled by the squared block size. */
+static inline uint32_t analysis_block_variance(const uint8_t *data)
+{
+	v16u8 samples;
+	v16u32 values, squares;
+	uint32_t sum = 0, sum_squares = 0;
+	unsigned int i;
+
+	memcpy(&samples, data, sizeof(samples));
+
+	values = __builtin_convertvector(samples, v16u32);
+	squares = values * values;
+
+	for (i = 0; i < ANALYSIS_BLOCK; i++) {
+		sum += values[i];
+		sum_squares += squares[i];
+	}
+
+	return sum_squares * ANALYSIS_BLOCK - sum * sum;
+}
+
+static inline void analysis_block_absdiff(const uint8_t *a, const uint8_t *b,
+					  v16s16 *sad)
+{
+	v16u8 samples_a, samples_b;
+	v16s16 diff, sign;
+
+	memcpy(&samples_a, a, sizeof(samples_a));
+	memcpy(&samples_b, b, sizeof(samples_b));
+
+	diff = __builtin_convertvector(samples_a, v16s16) -
+	       __builtin_convertvector(samples_b, v16s16);
+	sign = diff >> 15;
+
+	*sad += (diff ^ sign) - sign;
+}
+
+int analysis_init(struct analysis *analysis, unsigned int width,
+		  unsigned int height, unsigned int rows_step)
+{
+	unsigned int rows;
+
+	if (!analysis || !width || !height || !rows_step)
+		return -EINVAL;
+
+	memset(analysis, 0, sizeof(*analysis));
+
+	/* Only whole blocks are analyzed. */
+	analysis->width = width / ANALYSIS_BLOCK * ANALYSIS_BLOCK;
+	analysis->height = height;
+	analysis->rows_step = rows_step;
+
+	rows = (height + rows_step - 1) / rows_step;
+
+	analysis->previous = malloc(analysis->width * rows);
+	if (!analysis->previous)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void analysis_cleanup(struct analysis *analysis)
+{
+	if (!analysis)
+		return;
+
+	if (analysis->previous)
+		free(analysis->previous);
+
+	memset(analysis, 0, sizeof(*analysis));
+}
+
+void analysis_frame(struct analysis *analysis, uint8_t *luma,
+		    unsigned int stride)
+{
+	uint64_t variance = 0;
+	uint64_t sad = 0;
+	unsigned int samples = 0;
+	unsigned int delta = 0;
+	unsigned int blocks = 0;
+	unsigned int row = 0;
+	unsigned int x, y;
+	unsigned int i;
+
+	if (!analysis || !analysis->previous || !analysis->width)
+		return;
+
+	memcpy(analysis->histogram_previous, analysis->histogram,
+	       sizeof(analysis->histogram));
+	memset(analysis->histogram, 0, sizeof(analysis->histogram));
+
+	for (y = 0; y < analysis->height; y += analysis->rows_step) {
+		uint8_t *current = luma + y * stride;
+		uint8_t *previous = analysis->previous + row * analysis->width;
+		v16s16 sad_row = { 0 };
+
+		/* Lanes cannot overflow with up to 128 blocks per batch. */
+		for (x = 0; x < analysis->width; x += ANALYSIS_BLOCK) {
+			variance += analysis_block_variance(current + x);
+
+			if (analysis->previous_valid)
+				analysis_block_absdiff(current + x,
+						       previous + x, &sad_row);
+
+			if (((x / ANALYSIS_BLOCK) % 128) == 127) {
+				for (i = 0; i < ANALYSIS_BLOCK; i++)
+					sad += (uint16_t)sad_row[i];
+
+				memset(&sad_row, 0, sizeof(sad_row));
+			}
+
+			blocks++;
+		}
+
+		for (x = 0; x < ANALYSIS_BLOCK; x++)
+			sad += (uint16_t)sad_row[x];
+
+		/* The histogram only needs a sparse sampling. */
+		for (x = 0; x < analysis->width; x += 4) {
+			analysis->histogram[current[x] >> 2]++;
+			samples++;
+		}
+
+		memcpy(previous, current, analysis->width);
+		row++;
+	}
+
+	if (!blocks)
+		return;
+
+	analysis->variance = variance / blocks /
+			     (ANALYSIS_BLOCK * ANALYSIS_BLOCK);
+	analysis->sad = analysis->previous_valid ?
+			sad / (blocks * ANALYSIS_BLOCK) : 0;
+
+	for (x = 0; x < ANALYSIS_HISTOGRAM_BINS; x++) {
+		unsigned int a = analysis->histogram[x];
+		unsigned int b = analysis->histogram_previous[x];
+
+		delta += a > b ? a - b : b - a;
+	}
+
+	analysis->histogram_delta = analysis->previous_valid ?
+				    (uint64_t)delta * 1000 / (2 * samples) : 0;
+
+	/*
+	 * A cut changes both the pixels and their distribution: fast motion
+	 * alone raises the SAD but keeps the histogram, while fades keep the
+	 * SAD low. A fully different histogram is a cut on its own.
+	 */
+	analysis->scene_cut =
+		analysis->previous_valid && analysis->frames > 1 &&
+		((analysis->histogram_delta >= ANALYSIS_CUT_HISTOGRAM &&
+		  analysis->sad >= ANALYSIS_CUT_SAD_MIN &&
+		  analysis->sad > 3 * analysis->sad_average) ||
+		 analysis->histogram_delta >= ANALYSIS_CUT_HISTOGRAM_ALONE);
+
+	/* Running averages over roughly the last 8 frames. */
+	if (!analysis->frames || analysis->scene_cut)
+		analysis->variance_average = analysis->variance;
+	else
+		analysis->variance_average +=
+			(analysis->variance - analysis->variance_average) / 8.;
+
+	/* The SAD at a cut says nothing about the motion of the new scene. */
+	if (analysis->frames == 1)
+		analysis->sad_average = analysis->sad;
+	else if (analysis->frames > 1 && !analysis->scene_cut)
+		analysis->sad_average +=
+			(analysis->sad - analysis->sad_average) / 8.;
+
+	analysis->previous_valid = true;
+	analysis->frames++;
+}
+
+int analysis_qp_offset(struct analysis *analysis)
+{
+	float ratio;
+	int offset;
+
+	if (!analysis || !analysis->frames)
+		return 0;
+
+	/* Busy frames mask artifacts, flat frames show them. */
+	ratio = (analysis->variance + 1.) / (analysis->variance_average + 1.);
+	offset = lrintf(1.5 * log2f(ratio));
+
+	/* Static content is cheap to refine and is referenced for longer. */
+	if (analysis->frames > 1 && analysis->sad * 4 < analysis->sad_average)
+		offset--;
+
+	if (offset < -3)
+		offset = -3;
+	else if (offset > 3)
+		offset = 3;
+
+	return offset;
+}
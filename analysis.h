@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#ifndef _ANALYSIS_H_
+#define _ANALYSIS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ANALYSIS_HISTOGRAM_BINS	64
+
+struct analysis {
+	unsigned int width;
+	unsigned int height;
+	unsigned int rows_step;
+
+	/* Subsampled luma rows of the previous frame */
+	uint8_t *previous;
+	bool previous_valid;
+
+	/* Luma histograms of the current and previous frames */
+	unsigned int histogram[ANALYSIS_HISTOGRAM_BINS];
+	unsigned int histogram_previous[ANALYSIS_HISTOGRAM_BINS];
+
+	/* Last frame */
+	unsigned int variance;
+	unsigned int sad;
+	unsigned int histogram_delta;
+	bool scene_cut;
+
+	/* Running averages */
+	float variance_average;
+	float sad_average;
+	unsigned int frames;
+};
+
+int analysis_init(struct analysis *analysis, unsigned int width,
+		  unsigned int height, unsigned int rows_step);
+void analysis_cleanup(struct analysis *analysis);
+void analysis_frame(struct analysis *analysis, uint8_t *luma,
+		    unsigned int stride);
+int analysis_qp_offset(struct analysis *analysis);
+
+#endif
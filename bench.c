@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <linux/videodev2.h>
+
+#include <draw.h>
+#include <csc.h>
+#include <copy.h>
+#include <bench.h>
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+struct bench_allocator {
+	const char *name;
+	unsigned int flags;
+};
+
+static const struct bench_allocator bench_allocators[] = {
+	{ "calloc", 0 },
+	{ "aligned", DRAW_BUFFER_ALIGNED },
+	{ "aligned+populate", DRAW_BUFFER_ALIGNED | DRAW_BUFFER_POPULATE },
+	{ "aligned+hugepages", DRAW_BUFFER_ALIGNED | DRAW_BUFFER_HUGEPAGES |
+			       DRAW_BUFFER_POPULATE },
+};
+
+struct bench_staging {
+	const char *name;
+	bool staged;
+};
+
+static const struct bench_staging bench_stagings[] = {
+	{ "direct", false },
+	{ "staged", true },
+};
+
+static uint64_t bench_time(void)
+{
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static int bench_allocator_run(const struct bench_allocator *allocator,
+			       unsigned int width, unsigned int height,
+			       unsigned int frames, void *luma, void *chroma)
+{
+	struct draw_mandelbrot mandelbrot;
+	struct draw_buffer *buffer;
+	uint64_t time_alloc, time_mandelbrot, time_convert;
+	uint64_t time;
+	unsigned int i;
+
+	time = bench_time();
+
+	buffer = draw_buffer_create(width, height, allocator->flags);
+	if (!buffer)
+		return -ENOMEM;
+
+	time_alloc = bench_time() - time;
+
+	draw_mandelbrot_init(&mandelbrot);
+
+	time = bench_time();
+
+	for (i = 0; i < frames; i++) {
+		draw_mandelbrot_zoom(&mandelbrot);
+		draw_mandelbrot(&mandelbrot, buffer);
+	}
+
+	time_mandelbrot = bench_time() - time;
+	time = bench_time();
+
+	for (i = 0; i < frames; i++)
+		rgb2nv12(buffer, NULL, luma, chroma);
+
+	time_convert = bench_time() - time;
+
+	printf("%-20s %5u %9.3f %12.3f %12.3f%s\n", allocator->name,
+	       buffer->stride, time_alloc / 1000000.,
+	       time_mandelbrot / 1000000. / frames,
+	       time_convert / 1000000. / frames,
+	       buffer->hugetlb ? " (hugetlb)" : "");
+
+	draw_buffer_destroy(buffer);
+
+	return 0;
+}
+
+/* Plane writers and coded data reads, with and without staging. */
+static int bench_staging_run(const struct bench_staging *staging,
+			     struct draw_buffer *buffer, struct csc_image *dst,
+			     unsigned int frames, void *coded,
+			     unsigned int coded_size)
+{
+	const struct csc_kernel *kernel;
+	struct csc_image src;
+	uint64_t time_pattern, time_convert, time_coded;
+	unsigned int width = dst->width;
+	unsigned int height = dst->height;
+	unsigned int stride = dst->strides[0];
+	void *luma = dst->planes[0];
+	void *chroma = dst->planes[1];
+	uint64_t time;
+	unsigned int scratch_size;
+	void *scratch;
+	void *data;
+	unsigned int i;
+
+	kernel = csc_kernel_find(V4L2_PIX_FMT_XBGR32, dst->format);
+	if (!kernel)
+		return -EINVAL;
+
+	csc_image_setup(&src, V4L2_PIX_FMT_XBGR32, buffer->width,
+			buffer->height, buffer->data);
+	src.strides[0] = buffer->stride;
+
+	data = malloc(coded_size);
+	if (!data)
+		return -ENOMEM;
+
+	/* Staging lines are allocated once, as the encoder does. */
+	scratch_size = csc_staging_size(dst);
+	if (scratch_size < 2 * width)
+		scratch_size = 2 * width;
+
+	scratch = malloc(scratch_size);
+	if (!scratch) {
+		free(data);
+		return -ENOMEM;
+	}
+
+	time = bench_time();
+
+	for (i = 0; i < frames; i++) {
+		if (staging->staged)
+			test_pattern_step_staged(width, height, stride, i,
+						 luma, chroma, NULL, scratch);
+		else
+			test_pattern_step(width, height, stride, i, luma,
+					  chroma, NULL);
+	}
+
+	time_pattern = bench_time() - time;
+	time = bench_time();
+
+	for (i = 0; i < frames; i++) {
+		if (staging->staged)
+			csc_convert_staged(kernel, &src, dst, NULL, scratch);
+		else
+			csc_convert(kernel, &src, dst, NULL);
+	}
+
+	time_convert = bench_time() - time;
+	time = bench_time();
+
+	for (i = 0; i < frames; i++) {
+		if (staging->staged)
+			copy_prefetch(data, coded, coded_size);
+		else
+			memcpy(data, coded, coded_size);
+	}
+
+	time_coded = bench_time() - time;
+
+	printf("%-20s %12.3f %12.3f %12.3f\n", staging->name,
+	       time_pattern / 1000000. / frames,
+	       time_convert / 1000000. / frames,
+	       time_coded / 1000000. / frames);
+
+	free(scratch);
+	free(data);
+
+	return 0;
+}
+
+/*
+ * Destinations are NV12 planes, either malloc'd or mapped from the device,
+ * where write-combined or uncached mappings change which writers win.
+ */
+int bench_staging(const char *target, struct draw_buffer *buffer,
+		  struct csc_image *dst, unsigned int frames, void *coded,
+		  unsigned int coded_size)
+{
+	unsigned int i;
+	int ret;
+
+	if (!target || !buffer || !dst || !frames || !coded)
+		return -EINVAL;
+
+	if (dst->format != V4L2_PIX_FMT_NV12)
+		return -EINVAL;
+
+	printf("\n%-20s %12s %12s %12s\n", target, "pattern", "rgb2nv12",
+	       "coded read");
+
+	for (i = 0; i < ARRAY_SIZE(bench_stagings); i++) {
+		ret = bench_staging_run(&bench_stagings[i], buffer, dst,
+					frames, coded, coded_size);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int bench_run(unsigned int width, unsigned int height, unsigned int frames)
+{
+	struct draw_mandelbrot mandelbrot;
+	struct draw_buffer *buffer = NULL;
+	struct csc_image dst;
+	void *coded = NULL;
+	unsigned int coded_size = width * height / 4;
+	void *luma = NULL;
+	void *chroma = NULL;
+	unsigned int i;
+	int ret;
+
+	if (!width || !height || !frames)
+		return -EINVAL;
+
+	luma = malloc(width * height);
+	chroma = malloc(width * height / 2);
+	if (!luma || !chroma) {
+		ret = -ENOMEM;
+		goto complete;
+	}
+
+	printf("Benchmark at %ux%u over %u frames, times in ms\n", width,
+	       height, frames);
+	printf("%-20s %5s %9s %12s %12s\n", "allocator", "pitch", "alloc",
+	       "mandelbrot", "rgb2nv12");
+
+	for (i = 0; i < ARRAY_SIZE(bench_allocators); i++) {
+		ret = bench_allocator_run(&bench_allocators[i], width, height,
+					  frames, luma, chroma);
+		if (ret)
+			goto complete;
+	}
+
+	buffer = draw_buffer_create(width, height, DRAW_BUFFER_ALIGNED);
+	coded = malloc(coded_size);
+	if (!buffer || !coded) {
+		ret = -ENOMEM;
+		goto complete;
+	}
+
+	draw_mandelbrot_init(&mandelbrot);
+	draw_mandelbrot(&mandelbrot, buffer);
+	memset(coded, 0x5a, coded_size);
+
+	csc_image_setup(&dst, V4L2_PIX_FMT_NV12, width, height, NULL);
+	dst.planes[0] = luma;
+	dst.planes[1] = chroma;
+
+	ret = bench_staging("malloc", buffer, &dst, frames, coded, coded_size);
+
+complete:
+	if (buffer)
+		draw_buffer_destroy(buffer);
+
+	if (coded)
+		free(coded);
+
+	if (luma)
+		free(luma);
+
+	if (chroma)
+		free(chroma);
+
+	return ret;
+}
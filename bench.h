@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+int bench_staging(const char *target, struct draw_buffer *buffer,
+		  struct csc_image *dst, unsigned int frames, void *coded,
+		  unsigned int coded_size);
+int bench_run(unsigned int width, unsigned int height, unsigned int frames);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <control.h>
+
+int control_open(struct control *control, const char *path)
+{
+	int ret;
+
+	if (!control || !path)
+		return -EINVAL;
+
+	if (strlen(path) >= sizeof(control->address.sun_path))
+		return -ENAMETOOLONG;
+
+	memset(control, 0, sizeof(*control));
+
+	control->address.sun_family = AF_UNIX;
+	strcpy(control->address.sun_path, path);
+
+	control->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			     0);
+	if (control->fd < 0)
+		return -errno;
+
+	/* A stale socket from a previous run would make bind fail. */
+	unlink(path);
+
+	ret = bind(control->fd, (struct sockaddr *)&control->address,
+		   sizeof(control->address));
+	if (ret) {
+		ret = -errno;
+		close(control->fd);
+		control->fd = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+void control_close(struct control *control)
+{
+	if (!control || control->fd < 0)
+		return;
+
+	close(control->fd);
+	control->fd = -1;
+
+	unlink(control->address.sun_path);
+}
+
+int control_poll(struct control *control, unsigned int *keyframe_requests)
+{
+	char message[64];
+	unsigned int count = 0;
+	ssize_t length;
+
+	if (!control || control->fd < 0)
+		return -EINVAL;
+
+	/* Drain all pending datagrams without blocking. */
+	while (1) {
+		length = recv(control->fd, message, sizeof(message) - 1, 0);
+		if (length < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			return -errno;
+		}
+
+		while (length > 0 && (message[length - 1] == '\n' ||
+				      message[length - 1] == '\r'))
+			length--;
+
+		message[length] = '\0';
+
+		if (!strcmp(message, "keyframe"))
+			count++;
+		else
+			fprintf(stderr, "Unknown control message: %s\n",
+				message);
+	}
+
+	if (keyframe_requests)
+		*keyframe_requests = count;
+
+	return 0;
+}
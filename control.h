@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <sys/un.h>
+
+struct control {
+	int fd;
+	struct sockaddr_un address;
+};
+
+int control_open(struct control *control, const char *path);
+void control_close(struct control *control);
+int control_poll(struct control *control, unsigned int *keyframe_requests);
+
+#endif
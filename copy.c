@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <copy.h>
+
+/*
+ * Copies between cached memory and buffers that may be mapped
+ * write-combined or uncached, where only whole cache-line bursts are fast.
+ */
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+#define COPY_LINE		64
+#define COPY_PREFETCH_DISTANCE	(4 * COPY_LINE)
+
+/* Destination lines are written with full-width aligned stores only. */
+void copy_stream(void *dst, const void *src, size_t size)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head;
+
+	head = -(uintptr_t)d & (COPY_LINE - 1);
+	if (head > size)
+		head = size;
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for (; size >= COPY_LINE; size -= COPY_LINE) {
+		v16u8 line[COPY_LINE / sizeof(v16u8)];
+		unsigned int i;
+
+		memcpy(line, s, sizeof(line));
+
+		for (i = 0; i < COPY_LINE / sizeof(v16u8); i++)
+			((v16u8 *)d)[i] = line[i];
+
+		d += COPY_LINE;
+		s += COPY_LINE;
+	}
+
+	memcpy(d, s, size);
+}
+
+/* Source lines are requested ahead and read with full-width loads. */
+void copy_prefetch(void *dst, const void *src, size_t size)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+
+	for (; size >= COPY_LINE; size -= COPY_LINE) {
+		v16u8 line[COPY_LINE / sizeof(v16u8)];
+
+		__builtin_prefetch(s + COPY_PREFETCH_DISTANCE);
+
+		memcpy(line, s, sizeof(line));
+		memcpy(d, line, sizeof(line));
+
+		d += COPY_LINE;
+		s += COPY_LINE;
+	}
+
+	memcpy(d, s, size);
+}
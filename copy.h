@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#ifndef _COPY_H_
+#define _COPY_H_
+
+#include <stddef.h>
+
+void copy_stream(void *dst, const void *src, size_t size);
+void copy_prefetch(void *dst, const void *src, size_t size);
+
+#endif
@@ -4,105 +4,631 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <errno.h>
+#include <string.h>
 #include <math.h>
 
+#include <linux/videodev2.h>
+
 #include <draw.h>
 #include <csc.h>
+#include <copy.h>
+
+/* Image */
 
-int rgb2yuv420(struct draw_buffer *buffer, void *buffer_y, void *buffer_u,
-	       void *buffer_v)
+static uint32_t csc_format_base(uint32_t format)
 {
-	unsigned int width, height, stride;
-	unsigned int x, y;
-	void *data;
-	
-	if (!buffer)
+	switch (format) {
+	case V4L2_PIX_FMT_NV12M:
+		return V4L2_PIX_FMT_NV12;
+	case V4L2_PIX_FMT_NV21M:
+		return V4L2_PIX_FMT_NV21;
+	case V4L2_PIX_FMT_YUV420M:
+		return V4L2_PIX_FMT_YUV420;
+	default:
+		return format;
+	}
+}
+
+int csc_image_setup(struct csc_image *image, uint32_t format,
+		    unsigned int width, unsigned int height, void *data)
+{
+	unsigned int planes_count = 1;
+	unsigned int size = 0;
+	unsigned int i;
+
+	if (!image)
 		return -EINVAL;
 
-	data = buffer->data;
-	width = buffer->width;
-	height = buffer->height;
-	stride = buffer->stride;
+	memset(image, 0, sizeof(*image));
+
+	image->format = csc_format_base(format);
+	image->width = width;
+	image->height = height;
+
+	switch (image->format) {
+	case V4L2_PIX_FMT_XRGB32:
+	case V4L2_PIX_FMT_XBGR32:
+		image->strides[0] = width * 4;
+		break;
+	case V4L2_PIX_FMT_RGB24:
+		image->strides[0] = width * 3;
+		break;
+	case V4L2_PIX_FMT_RGB565:
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+		image->strides[0] = width * 2;
+		break;
+	/* Odd dimensions round chroma up to cover the last pixels. */
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+		image->strides[0] = width;
+		image->strides[1] = (width + 1) & ~1;
+		image->sizes[1] = image->strides[1] * ((height + 1) / 2);
+		planes_count = 2;
+		break;
+	case V4L2_PIX_FMT_YUV420:
+		image->strides[0] = width;
+		image->strides[1] = (width + 1) / 2;
+		image->strides[2] = (width + 1) / 2;
+		image->sizes[1] = image->strides[1] * ((height + 1) / 2);
+		image->sizes[2] = image->strides[2] * ((height + 1) / 2);
+		planes_count = 3;
+		break;
+	default:
+		return -EINVAL;
+	}
 
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			uint8_t *crgb;
-			uint8_t *cy;
-			float value;
+	image->sizes[0] = image->strides[0] * height;
+	image->planes_count = planes_count;
 
-			crgb = data + stride * y + x * 4;
-			value = crgb[2] * 0.299 + crgb[1] * 0.587 + crgb[0] * 0.114;
+	/* Planes are packed one after the other. */
+	for (i = 0; i < planes_count; i++) {
+		if (data)
+			image->planes[i] = data + size;
 
-			cy = buffer_y + width * y + x;
-			*cy = byte_range(value);
+		size += image->sizes[i];
+	}
 
-			if ((x % 2) == 0 && (y % 2) == 0) {
-				uint8_t *cu;
-				uint8_t *cv;
+	return size;
+}
 
-				value = crgb[2] * -0.14713 + crgb[1] * -0.28886 + crgb[0] * 0.436 + 128.;
+/* Kernels */
 
-				cu = buffer_u + width / 2 * y / 2 + x / 2;
-				*cu = byte_range(value);
+#define CSC_FIX(value)	((int)((value) * 65536. + ((value) < 0 ? -0.5 : 0.5)))
 
-				value = crgb[2] * 0.615 + crgb[1] * -0.51499 + crgb[0] * -0.10001 + 128.;
+static inline __attribute__((always_inline)) uint8_t csc_clamp(int value)
+{
+	if (value < 0)
+		return 0;
+	else if (value > 255)
+		return 255;
+	else
+		return value;
+}
 
-				cv = buffer_v + width / 2 * y / 2 + x / 2;
-				*cv = byte_range(value);
-			}
-		}
+static inline __attribute__((always_inline)) uint8_t csc_rgb_y(int r, int g,
+							       int b)
+{
+	return (CSC_FIX(0.299) * r + CSC_FIX(0.587) * g + CSC_FIX(0.114) * b +
+		32768) >> 16;
+}
+
+static inline __attribute__((always_inline)) uint8_t csc_rgb_u(int r, int g,
+							       int b)
+{
+	return csc_clamp((CSC_FIX(-0.14713) * r + CSC_FIX(-0.28886) * g +
+			  CSC_FIX(0.436) * b + (128 << 16) + 32768) >> 16);
+}
+
+static inline __attribute__((always_inline)) uint8_t csc_rgb_v(int r, int g,
+							       int b)
+{
+	return csc_clamp((CSC_FIX(0.615) * r + CSC_FIX(-0.51499) * g +
+			  CSC_FIX(-0.10001) * b + (128 << 16) + 32768) >> 16);
+}
+
+/*
+ * Fetchers load the luma of a 2x2 block at (x, y) and its chroma, taken from
+ * the top-left pixel for RGB and the top row for 4:2:2 sources. Blocks on an
+ * odd right or bottom edge pass a zero dx or dy to repeat the edge pixels.
+ */
+
+#define CSC_FETCH_RGB(name, bpp, load)					\
+static inline __attribute__((always_inline))				\
+void csc_fetch_##name(struct csc_image *src, unsigned int x,		\
+		      unsigned int y, unsigned int dx, unsigned int dy,	\
+		      uint8_t *luma, uint8_t *u, uint8_t *v)		\
+{									\
+	uint8_t *row = src->planes[0] + y * src->strides[0] + x * bpp;	\
+	unsigned int i;							\
+	int r, g, b;							\
+									\
+	for (i = 0; i < 4; i++) {					\
+		uint8_t *p = row + (i / 2) * dy * src->strides[0] +	\
+			     (i % 2) * dx * bpp;			\
+									\
+		load(p, r, g, b);					\
+		luma[i] = csc_rgb_y(r, g, b);				\
+									\
+		if (!i) {						\
+			*u = csc_rgb_u(r, g, b);			\
+			*v = csc_rgb_v(r, g, b);			\
+		}							\
+	}								\
+}
+
+#define CSC_LOAD_XRGB32(p, r, g, b) \
+	do { r = p[1]; g = p[2]; b = p[3]; } while (0)
+#define CSC_LOAD_XBGR32(p, r, g, b) \
+	do { r = p[2]; g = p[1]; b = p[0]; } while (0)
+#define CSC_LOAD_RGB24(p, r, g, b) \
+	do { r = p[0]; g = p[1]; b = p[2]; } while (0)
+#define CSC_LOAD_RGB565(p, r, g, b)					\
+	do {								\
+		unsigned int word = p[0] | (p[1] << 8);			\
+									\
+		r = (word >> 11) & 0x1f;				\
+		g = (word >> 5) & 0x3f;					\
+		b = word & 0x1f;					\
+		r = (r << 3) | (r >> 2);				\
+		g = (g << 2) | (g >> 4);				\
+		b = (b << 3) | (b >> 2);				\
+	} while (0)
+
+CSC_FETCH_RGB(xrgb32, 4, CSC_LOAD_XRGB32)
+CSC_FETCH_RGB(xbgr32, 4, CSC_LOAD_XBGR32)
+CSC_FETCH_RGB(rgb24, 3, CSC_LOAD_RGB24)
+CSC_FETCH_RGB(rgb565, 2, CSC_LOAD_RGB565)
+
+#define CSC_FETCH_PACKED(name, y0, u0, y1, v0)				\
+static inline __attribute__((always_inline))				\
+void csc_fetch_##name(struct csc_image *src, unsigned int x,		\
+		      unsigned int y, unsigned int dx, unsigned int dy,	\
+		      uint8_t *luma, uint8_t *u, uint8_t *v)		\
+{									\
+	uint8_t *top = src->planes[0] + y * src->strides[0] + x * 2;	\
+	uint8_t *bottom = top + dy * src->strides[0];			\
+									\
+	luma[0] = top[y0];						\
+	luma[1] = dx ? top[y1] : top[y0];				\
+	luma[2] = bottom[y0];						\
+	luma[3] = dx ? bottom[y1] : bottom[y0];				\
+	*u = top[u0];							\
+	*v = top[v0];							\
+}
+
+CSC_FETCH_PACKED(yuyv, 0, 1, 2, 3)
+CSC_FETCH_PACKED(uyvy, 1, 0, 3, 2)
+
+#define CSC_FETCH_SEMIPLANAR(name, u0, v0)				\
+static inline __attribute__((always_inline))				\
+void csc_fetch_##name(struct csc_image *src, unsigned int x,		\
+		      unsigned int y, unsigned int dx, unsigned int dy,	\
+		      uint8_t *luma, uint8_t *u, uint8_t *v)		\
+{									\
+	uint8_t *top = src->planes[0] + y * src->strides[0] + x;	\
+	uint8_t *bottom = top + dy * src->strides[0];			\
+	uint8_t *chroma = src->planes[1] + y / 2 * src->strides[1] + x;	\
+									\
+	luma[0] = top[0];						\
+	luma[1] = top[dx];						\
+	luma[2] = bottom[0];						\
+	luma[3] = bottom[dx];						\
+	*u = chroma[u0];						\
+	*v = chroma[v0];						\
+}
+
+CSC_FETCH_SEMIPLANAR(nv12, 0, 1)
+CSC_FETCH_SEMIPLANAR(nv21, 1, 0)
+
+static inline __attribute__((always_inline))
+void csc_fetch_yuv420(struct csc_image *src, unsigned int x, unsigned int y,
+		      unsigned int dx, unsigned int dy, uint8_t *luma,
+		      uint8_t *u, uint8_t *v)
+{
+	uint8_t *top = src->planes[0] + y * src->strides[0] + x;
+	uint8_t *bottom = top + dy * src->strides[0];
+
+	luma[0] = top[0];
+	luma[1] = top[dx];
+	luma[2] = bottom[0];
+	luma[3] = bottom[dx];
+	*u = *((uint8_t *)src->planes[1] + y / 2 * src->strides[1] + x / 2);
+	*v = *((uint8_t *)src->planes[2] + y / 2 * src->strides[2] + x / 2);
+}
+
+/*
+ * Storers write a 2x2 block of luma and its chroma at (x, y), edge blocks
+ * storing their repeated pixels over the same location.
+ */
+
+#define CSC_STORE_SEMIPLANAR(name, u0, v0)				\
+static inline __attribute__((always_inline))				\
+void csc_store_##name(struct csc_image *dst, unsigned int x,		\
+		      unsigned int y, unsigned int dx, unsigned int dy,	\
+		      uint8_t *luma, uint8_t u, uint8_t v)		\
+{									\
+	uint8_t *top = dst->planes[0] + y * dst->strides[0] + x;	\
+	uint8_t *bottom = top + dy * dst->strides[0];			\
+	uint8_t *chroma = dst->planes[1] + y / 2 * dst->strides[1] + x;	\
+									\
+	top[0] = luma[0];						\
+	top[dx] = luma[1];						\
+	bottom[0] = luma[2];						\
+	bottom[dx] = luma[3];						\
+	chroma[u0] = u;							\
+	chroma[v0] = v;							\
+}
+
+CSC_STORE_SEMIPLANAR(nv12, 0, 1)
+CSC_STORE_SEMIPLANAR(nv21, 1, 0)
+
+static inline __attribute__((always_inline))
+void csc_store_yuv420(struct csc_image *dst, unsigned int x, unsigned int y,
+		      unsigned int dx, unsigned int dy, uint8_t *luma,
+		      uint8_t u, uint8_t v)
+{
+	uint8_t *top = dst->planes[0] + y * dst->strides[0] + x;
+	uint8_t *bottom = top + dy * dst->strides[0];
+
+	top[0] = luma[0];
+	top[dx] = luma[1];
+	bottom[0] = luma[2];
+	bottom[dx] = luma[3];
+	*((uint8_t *)dst->planes[1] + y / 2 * dst->strides[1] + x / 2) = u;
+	*((uint8_t *)dst->planes[2] + y / 2 * dst->strides[2] + x / 2) = v;
+}
+
+/*
+ * Each (source, destination) pair gets its own specialized loop, with the
+ * odd edges handled out of it so that full blocks keep constant offsets.
+ */
+
+#define CSC_KERNEL(src_name, dst_name)					\
+static inline __attribute__((always_inline))				\
+void csc_##src_name##_##dst_name##_row(struct csc_image *src,		\
+				       struct csc_image *dst,		\
+				       unsigned int x_start,		\
+				       unsigned int x_stop,		\
+				       unsigned int y, unsigned int dy)	\
+{									\
+	uint8_t luma[4];						\
+	uint8_t u, v;							\
+	unsigned int x;							\
+									\
+	for (x = x_start; x + 1 < x_stop; x += 2) {			\
+		csc_fetch_##src_name(src, x, y, 1, dy, luma, &u, &v);	\
+		csc_store_##dst_name(dst, x, y, 1, dy, luma, u, v);	\
+	}								\
+									\
+	if (x < x_stop) {						\
+		csc_fetch_##src_name(src, x, y, 0, dy, luma, &u, &v);	\
+		csc_store_##dst_name(dst, x, y, 0, dy, luma, u, v);	\
+	}								\
+}									\
+									\
+static void csc_##src_name##_##dst_name(struct csc_image *src,		\
+					struct csc_image *dst,		\
+					unsigned int x_start,		\
+					unsigned int x_stop,		\
+					unsigned int y_start,		\
+					unsigned int y_stop)		\
+{									\
+	unsigned int y;							\
+									\
+	for (y = y_start; y + 1 < y_stop; y += 2)			\
+		csc_##src_name##_##dst_name##_row(src, dst, x_start,	\
+						  x_stop, y, 1);	\
+									\
+	if (y < y_stop)							\
+		csc_##src_name##_##dst_name##_row(src, dst, x_start,	\
+						  x_stop, y, 0);	\
+}
+
+#define CSC_KERNELS(src_name)						\
+	CSC_KERNEL(src_name, nv12)					\
+	CSC_KERNEL(src_name, nv21)					\
+	CSC_KERNEL(src_name, yuv420)
+
+CSC_KERNELS(xrgb32)
+CSC_KERNELS(xbgr32)
+CSC_KERNELS(rgb24)
+CSC_KERNELS(rgb565)
+CSC_KERNELS(yuyv)
+CSC_KERNELS(uyvy)
+CSC_KERNEL(nv12, nv21)
+CSC_KERNEL(nv12, yuv420)
+CSC_KERNEL(nv21, nv12)
+CSC_KERNEL(nv21, yuv420)
+CSC_KERNEL(yuv420, nv12)
+CSC_KERNEL(yuv420, nv21)
+
+/* Identical YUV 4:2:0 layouts only need their rows copied. */
+
+static void csc_copy(struct csc_image *src, struct csc_image *dst,
+		     unsigned int x_start, unsigned int x_stop,
+		     unsigned int y_start, unsigned int y_stop)
+{
+	unsigned int i, y;
+
+	for (i = 0; i < src->planes_count; i++) {
+		/* Chroma rows are subsampled, so are fully planar columns. */
+		unsigned int vsub = i ? 2 : 1;
+		unsigned int hsub = (i && src->planes_count == 3) ? 2 : 1;
+		unsigned int x_end = i ? (x_stop + 1) & ~1 : x_stop;
+		unsigned int offset = x_start / hsub;
+		unsigned int length = (x_end - x_start) / hsub;
+
+		for (y = y_start / vsub; y < (y_stop + vsub - 1) / vsub; y++)
+			memcpy(dst->planes[i] + y * dst->strides[i] + offset,
+			       src->planes[i] + y * src->strides[i] + offset,
+			       length);
+	}
+}
+
+/* Costs are relative per-pixel work, a row copy being the unit. */
+
+#define CSC_COST_COPY		1
+#define CSC_COST_YUV		2
+#define CSC_COST_PACKED		3
+#define CSC_COST_RGB		4
+
+#define CSC_ENTRY(src_format, dst_format, src_name, dst_name, cost)	\
+	{ V4L2_PIX_FMT_##src_format, V4L2_PIX_FMT_##dst_format,		\
+	  csc_##src_name##_##dst_name, cost }
+
+#define CSC_ENTRIES(src_format, src_name, cost)				\
+	CSC_ENTRY(src_format, NV12, src_name, nv12, cost),		\
+	CSC_ENTRY(src_format, NV21, src_name, nv21, cost),		\
+	CSC_ENTRY(src_format, YUV420, src_name, yuv420, cost)
+
+#define CSC_ENTRY_COPY(format)						\
+	{ V4L2_PIX_FMT_##format, V4L2_PIX_FMT_##format, csc_copy,	\
+	  CSC_COST_COPY }
+
+static const struct csc_kernel csc_kernels[] = {
+	CSC_ENTRIES(XRGB32, xrgb32, CSC_COST_RGB),
+	CSC_ENTRIES(XBGR32, xbgr32, CSC_COST_RGB),
+	CSC_ENTRIES(RGB24, rgb24, CSC_COST_RGB),
+	CSC_ENTRIES(RGB565, rgb565, CSC_COST_RGB),
+	CSC_ENTRIES(YUYV, yuyv, CSC_COST_PACKED),
+	CSC_ENTRIES(UYVY, uyvy, CSC_COST_PACKED),
+	CSC_ENTRY_COPY(NV12),
+	CSC_ENTRY(NV12, NV21, nv12, nv21, CSC_COST_YUV),
+	CSC_ENTRY(NV12, YUV420, nv12, yuv420, CSC_COST_YUV),
+	CSC_ENTRY(NV21, NV12, nv21, nv12, CSC_COST_YUV),
+	CSC_ENTRY_COPY(NV21),
+	CSC_ENTRY(NV21, YUV420, nv21, yuv420, CSC_COST_YUV),
+	CSC_ENTRY(YUV420, NV12, yuv420, nv12, CSC_COST_YUV),
+	CSC_ENTRY(YUV420, NV21, yuv420, nv21, CSC_COST_YUV),
+	CSC_ENTRY_COPY(YUV420),
+};
+
+const struct csc_kernel *csc_kernel_find(uint32_t src_format,
+					 uint32_t dst_format)
+{
+	unsigned int count = sizeof(csc_kernels) / sizeof(csc_kernels[0]);
+	unsigned int i;
+
+	src_format = csc_format_base(src_format);
+	dst_format = csc_format_base(dst_format);
+
+	for (i = 0; i < count; i++)
+		if (csc_kernels[i].src_format == src_format &&
+		    csc_kernels[i].dst_format == dst_format)
+			return &csc_kernels[i];
+
+	return NULL;
+}
+
+bool csc_format_match(uint32_t format, uint32_t other)
+{
+	return csc_format_base(format) == csc_format_base(other);
+}
+
+static int csc_bounds(struct csc_image *src, struct csc_image *dst,
+		      struct draw_region *region, unsigned int *x_start,
+		      unsigned int *x_stop, unsigned int *y_start,
+		      unsigned int *y_stop)
+{
+	unsigned int x_limit, y_limit;
+
+	/* Only the area common to both images is converted. */
+	x_limit = src->width < dst->width ? src->width : dst->width;
+	y_limit = src->height < dst->height ? src->height : dst->height;
+
+	*x_start = 0;
+	*x_stop = x_limit;
+	*y_start = 0;
+	*y_stop = y_limit;
+
+	/* Align to the chroma subsampling grid. */
+	if (region) {
+		*x_start = region->x & ~1;
+		*x_stop = (region->x + region->width + 1) & ~1;
+		*y_start = region->y & ~1;
+		*y_stop = (region->y + region->height + 1) & ~1;
+
+		if (*x_stop > x_limit)
+			*x_stop = x_limit;
+
+		if (*y_stop > y_limit)
+			*y_stop = y_limit;
 	}
 
 	return 0;
 }
 
-int rgb2nv12(struct draw_buffer *buffer, void *buffer_y, void *buffer_uv)
+int csc_convert(const struct csc_kernel *kernel, struct csc_image *src,
+		struct csc_image *dst, struct draw_region *region)
 {
-	unsigned int width, height, stride;
-	unsigned int x, y;
-	void *data;
+	unsigned int x_start, x_stop, y_start, y_stop;
+	int ret;
 
-	if (!buffer)
+	if (!kernel || !src || !dst)
 		return -EINVAL;
 
-	data = buffer->data;
-	width = buffer->width;
-	height = buffer->height;
-	stride = buffer->stride;
+	ret = csc_bounds(src, dst, region, &x_start, &x_stop, &y_start,
+			 &y_stop);
+	if (ret)
+		return ret;
 
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			uint8_t *crgb;
-			uint8_t *cy;
-			float value;
+	kernel->convert(src, dst, x_start, x_stop, y_start, y_stop);
 
-			crgb = data + stride * y + x * 4;
-			value = crgb[2] * 0.299 + crgb[1] * 0.587 + crgb[0] * 0.114;
+	return 0;
+}
+
+/* Flushes the destination rows covered by one or two image rows. */
+static void csc_rows_flush(struct csc_image *lines, struct csc_image *dst,
+			   unsigned int x_start, unsigned int x_stop,
+			   unsigned int y, unsigned int count)
+{
+	unsigned int i, row;
+
+	for (i = 0; i < dst->planes_count; i++) {
+		unsigned int vsub = i ? 2 : 1;
+		unsigned int hsub = (i && dst->planes_count == 3) ? 2 : 1;
+		unsigned int x_end = i ? (x_stop + 1) & ~1 : x_stop;
+		unsigned int offset = x_start / hsub;
+		unsigned int length = (x_end - x_start) / hsub;
+
+		for (row = 0; row < (count + vsub - 1) / vsub; row++)
+			copy_stream(dst->planes[i] +
+				    (y / vsub + row) * dst->strides[i] + offset,
+				    lines->planes[i] + row * lines->strides[i] +
+				    offset, length);
+	}
+}
+
+/* Scratch size needed by csc_convert_staged for a destination. */
+unsigned int csc_staging_size(struct csc_image *dst)
+{
+	unsigned int size = 0;
+	unsigned int i;
+
+	for (i = 0; i < dst->planes_count; i++)
+		size += dst->strides[i] * (i ? 1 : 2);
 
-			cy = buffer_y + width * y + x;
-			*cy = byte_range(value);
+	return size;
+}
 
-			if ((x % 2) == 0 && (y % 2) == 0) {
-				uint8_t *cu;
-				uint8_t *cv;
+/*
+ * Pairs of rows are converted into cached scratch lines, then flushed to
+ * the destination with wide stores, for destinations mapped write-combined
+ * or uncached where the kernels' scattered byte stores are slow.
+ * The scratch holds at least csc_staging_size bytes and is kept by the
+ * caller across frames.
+ */
+int csc_convert_staged(const struct csc_kernel *kernel,
+		       struct csc_image *src, struct csc_image *dst,
+		       struct draw_region *region, void *scratch)
+{
+	unsigned int x_start, x_stop, y_start, y_stop;
+	struct csc_image rows;
+	struct csc_image lines;
+	unsigned int size;
+	unsigned int i, y;
+	int ret;
+
+	if (!kernel || !src || !dst || !scratch)
+		return -EINVAL;
 
-				value = crgb[2] * -0.14713 + crgb[1] * -0.28886 + crgb[0] * 0.436 + 128.;
+	ret = csc_bounds(src, dst, region, &x_start, &x_stop, &y_start,
+			 &y_stop);
+	if (ret)
+		return ret;
 
-				cu = buffer_uv + width * y / 2 + x;
-				*cu = byte_range(value);
+	/* Copies have nothing to stage and stream rows directly. */
+	if (kernel->convert == csc_copy) {
+		struct csc_image copy = *src;
 
-				value = crgb[2] * 0.615 + crgb[1] * -0.51499 + crgb[0] * -0.10001 + 128.;
+		for (y = y_start; y < y_stop; y += 2) {
+			for (i = 0; i < src->planes_count; i++)
+				copy.planes[i] = src->planes[i] +
+						 y / (i ? 2 : 1) *
+						 src->strides[i];
 
-				cv = buffer_uv + width * y / 2 + x + 1;
-				*cv = byte_range(value);
-			}
+			csc_rows_flush(&copy, dst, x_start, x_stop, y,
+				       y + 1 < y_stop ? 2 : 1);
 		}
+
+		return 0;
+	}
+
+	lines = *dst;
+
+	for (i = 0, size = 0; i < dst->planes_count; i++) {
+		lines.planes[i] = scratch + size;
+		size += dst->strides[i] * (i ? 1 : 2);
+	}
+
+	for (y = y_start; y < y_stop; y += 2) {
+		unsigned int count = y + 1 < y_stop ? 2 : 1;
+
+		rows = *src;
+
+		/* Only planar chroma rows of the sources are subsampled. */
+		for (i = 0; i < src->planes_count; i++)
+			rows.planes[i] = src->planes[i] +
+					 y / (i ? 2 : 1) * src->strides[i];
+
+		kernel->convert(&rows, &lines, x_start, x_stop, 0, count);
+
+		csc_rows_flush(&lines, dst, x_start, x_stop, y, count);
 	}
 
 	return 0;
 }
 
+/* Draw buffer */
+
+static int csc_draw_convert(struct draw_buffer *buffer,
+			    struct draw_region *region, uint32_t dst_format,
+			    void *buffer_y, void *buffer_u, void *buffer_v)
+{
+	const struct csc_kernel *kernel;
+	struct csc_image src;
+	struct csc_image dst;
+	int ret;
+
+	if (!buffer)
+		return -EINVAL;
+
+	/* Cairo stores native-endian ARGB, which is B, G, R, X in memory. */
+	kernel = csc_kernel_find(V4L2_PIX_FMT_XBGR32, dst_format);
+
+	csc_image_setup(&src, V4L2_PIX_FMT_XBGR32, buffer->width,
+			buffer->height, buffer->data);
+	src.strides[0] = buffer->stride;
+
+	ret = csc_image_setup(&dst, dst_format, buffer->width, buffer->height,
+			      NULL);
+	if (ret < 0)
+		return ret;
+
+	dst.planes[0] = buffer_y;
+	dst.planes[1] = buffer_u;
+	dst.planes[2] = buffer_v;
+
+	return csc_convert(kernel, &src, &dst, region);
+}
+
+int rgb2yuv420(struct draw_buffer *buffer, struct draw_region *region,
+	       void *buffer_y, void *buffer_u, void *buffer_v)
+{
+	return csc_draw_convert(buffer, region, V4L2_PIX_FMT_YUV420, buffer_y,
+				buffer_u, buffer_v);
+}
+
+int rgb2nv12(struct draw_buffer *buffer, struct draw_region *region,
+	     void *buffer_y, void *buffer_uv)
+{
+	return csc_draw_convert(buffer, region, V4L2_PIX_FMT_NV12, buffer_y,
+				buffer_uv, NULL);
+}
+
 unsigned int rgb_pixel(unsigned int r, unsigned int g, unsigned int b)
 {
 	return (255 << 24) | (r << 16) | (g << 8) | (b << 0);
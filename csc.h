@@ -15,9 +15,42 @@ static inline uint8_t byte_range(float v)
 		return (uint8_t)v;
 }
 
-int rgb2yuv420(struct draw_buffer *buffer, void *buffer_y, void *buffer_u,
-	       void *buffer_v);
-int rgb2nv12(struct draw_buffer *buffer, void *buffer_y, void *buffer_uv);
+struct csc_image {
+	uint32_t format;
+	unsigned int width;
+	unsigned int height;
+
+	void *planes[3];
+	unsigned int strides[3];
+	unsigned int sizes[3];
+	unsigned int planes_count;
+};
+
+struct csc_kernel {
+	uint32_t src_format;
+	uint32_t dst_format;
+
+	void (*convert)(struct csc_image *src, struct csc_image *dst,
+			unsigned int x_start, unsigned int x_stop,
+			unsigned int y_start, unsigned int y_stop);
+	unsigned int cost;
+};
+
+int csc_image_setup(struct csc_image *image, uint32_t format,
+		    unsigned int width, unsigned int height, void *data);
+const struct csc_kernel *csc_kernel_find(uint32_t src_format,
+					 uint32_t dst_format);
+bool csc_format_match(uint32_t format, uint32_t other);
+int csc_convert(const struct csc_kernel *kernel, struct csc_image *src,
+		struct csc_image *dst, struct draw_region *region);
+unsigned int csc_staging_size(struct csc_image *dst);
+int csc_convert_staged(const struct csc_kernel *kernel,
+		       struct csc_image *src, struct csc_image *dst,
+		       struct draw_region *region, void *scratch);
+int rgb2yuv420(struct draw_buffer *buffer, struct draw_region *region,
+	       void *buffer_y, void *buffer_u, void *buffer_v);
+int rgb2nv12(struct draw_buffer *buffer, struct draw_region *region,
+	     void *buffer_y, void *buffer_uv);
 unsigned int rgb_pixel(unsigned int r, unsigned int g, unsigned int b);
 unsigned int hsv2rgb_pixel(float hi, float si, float vi);
 
@@ -4,19 +4,76 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <wchar.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <cairo.h>
 
 #include <draw.h>
 #include <csc.h>
+#include <copy.h>
 
-struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height)
+#define DRAW_BUFFER_ALIGNMENT		64
+#define DRAW_BUFFER_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+#define DRAW_BUFFER_PAGE_SIZE		4096
+
+#define DRAW_ALIGN(value, alignment) \
+	(((value) + (alignment) - 1) & ~((alignment) - 1))
+
+static void *draw_buffer_map(struct draw_buffer *buffer, unsigned int flags)
+{
+	int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	size_t size = buffer->size;
+	void *data = MAP_FAILED;
+	size_t i;
+
+	if (flags & DRAW_BUFFER_HUGEPAGES) {
+		size = DRAW_ALIGN(size, DRAW_BUFFER_HUGEPAGE_SIZE);
+
+		/* Explicit huge pages need a reserved pool. */
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    map_flags | MAP_HUGETLB |
+			    (flags & DRAW_BUFFER_POPULATE ? MAP_POPULATE : 0),
+			    -1, 0);
+		if (data != MAP_FAILED)
+			buffer->hugetlb = true;
+	}
+
+	if (data == MAP_FAILED) {
+		/* Populating before the advice would fault in small pages. */
+		if (!(flags & DRAW_BUFFER_HUGEPAGES) &&
+		    (flags & DRAW_BUFFER_POPULATE))
+			map_flags |= MAP_POPULATE;
+
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, map_flags, -1,
+			    0);
+		if (data == MAP_FAILED)
+			return NULL;
+
+		if (flags & DRAW_BUFFER_HUGEPAGES) {
+			madvise(data, size, MADV_HUGEPAGE);
+
+			if (flags & DRAW_BUFFER_POPULATE)
+				for (i = 0; i < size; i += DRAW_BUFFER_PAGE_SIZE)
+					((volatile uint8_t *)data)[i] = 0;
+		}
+	}
+
+	buffer->map_size = size;
+
+	return data;
+}
+
+struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height,
+				       unsigned int flags)
 {
 	struct draw_buffer *buffer = NULL;
 	unsigned int stride;
 	unsigned int size;
+	int ret;
 
 	if (!width || !height)
 		return NULL;
@@ -26,14 +83,32 @@ struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height)
 		goto error;
 
 	stride = width * 4;
+
+	/* Padded rows keep every line aligned for vector loads. */
+	if (flags & DRAW_BUFFER_ALIGNED)
+		stride = DRAW_ALIGN(stride, DRAW_BUFFER_ALIGNMENT);
+
 	size = stride * height;
 
 	buffer->width = width;
 	buffer->height = height;
 	buffer->stride = stride;
+	buffer->flags = flags;
 
 	buffer->size = size;
-	buffer->data = calloc(1, size);
+
+	if (flags & (DRAW_BUFFER_HUGEPAGES | DRAW_BUFFER_POPULATE)) {
+		buffer->data = draw_buffer_map(buffer, flags);
+	} else if (flags & DRAW_BUFFER_ALIGNED) {
+		ret = posix_memalign(&buffer->data, DRAW_BUFFER_ALIGNMENT,
+				     size);
+		if (ret)
+			buffer->data = NULL;
+		else
+			memset(buffer->data, 0, size);
+	} else {
+		buffer->data = calloc(1, size);
+	}
 
 	if (!buffer->data)
 		goto error;
@@ -52,12 +127,85 @@ void draw_buffer_destroy(struct draw_buffer *buffer)
 	if (!buffer)
 		return;
 
-	if (buffer->data)
+	if (buffer->data && buffer->map_size)
+		munmap(buffer->data, buffer->map_size);
+	else if (buffer->data)
 		free(buffer->data);
 
 	free(buffer);
 }
 
+static struct draw_buffer *draw_buffers_shared;
+static pthread_mutex_t draw_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Shared buffers are looked up by geometry and allocation flags, so that a
+ * user never gets a pitch or backing it did not ask for, and are
+ * reference-counted. Pixels are not locked: users take turns drawing and
+ * converting, which only holds within a thread, so buffers are never
+ * shared across threads and each thread gets its own.
+ */
+struct draw_buffer *draw_buffer_get(unsigned int width, unsigned int height,
+				    unsigned int flags)
+{
+	struct draw_buffer *buffer;
+
+	pthread_mutex_lock(&draw_buffers_lock);
+
+	for (buffer = draw_buffers_shared; buffer; buffer = buffer->next) {
+		if (buffer->width == width && buffer->height == height &&
+		    buffer->flags == flags &&
+		    pthread_equal(buffer->thread, pthread_self())) {
+			buffer->references++;
+			goto complete;
+		}
+	}
+
+	buffer = draw_buffer_create(width, height, flags);
+	if (!buffer)
+		goto complete;
+
+	buffer->references = 1;
+	buffer->thread = pthread_self();
+	buffer->next = draw_buffers_shared;
+	draw_buffers_shared = buffer;
+
+complete:
+	pthread_mutex_unlock(&draw_buffers_lock);
+
+	return buffer;
+}
+
+void draw_buffer_put(struct draw_buffer *buffer)
+{
+	struct draw_buffer **link;
+
+	if (!buffer)
+		return;
+
+	if (!buffer->references) {
+		draw_buffer_destroy(buffer);
+		return;
+	}
+
+	pthread_mutex_lock(&draw_buffers_lock);
+
+	if (--buffer->references)
+		goto complete;
+
+	for (link = &draw_buffers_shared; *link; link = &(*link)->next) {
+		if (*link == buffer) {
+			*link = buffer->next;
+			break;
+		}
+	}
+
+	draw_buffer_destroy(buffer);
+
+complete:
+	pthread_mutex_unlock(&draw_buffers_lock);
+}
+
 void draw_png(struct draw_buffer *buffer, char *path)
 {
 	cairo_surface_t *surface = NULL;
@@ -142,52 +290,109 @@ static struct nv12_color colors[] = {
 
 static unsigned int colors_count = sizeof(colors) / sizeof(*colors);
 
-void test_pattern_step(unsigned int width, unsigned int height, unsigned int stride, unsigned int step, void *luma, void *chroma)
+void test_pattern_box(unsigned int width, unsigned int height,
+		      unsigned int step, struct draw_region *region)
 {
 	unsigned int box_height = 50;
-	unsigned int box_y = ((step * 2) % (height - box_height));
-	unsigned int x, y, i;
-	unsigned char *l, *c;
-	unsigned int color_width = width / colors_count;
 
-	l = luma;
-	c = chroma;
+	region->x = 0;
+	region->y = ((step * 2) % (height - box_height));
+	region->width = width;
+	region->height = box_height;
+}
 
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			unsigned int index = x / color_width;
-			struct nv12_color color = colors[index];
+static void test_pattern_line(unsigned int width, unsigned int y,
+			      struct draw_region *box, unsigned char *l,
+			      unsigned char *c)
+{
+	bool inverted = (y >= box->y && y < (box->y + box->height));
+	unsigned int color_width = width / colors_count;
+	unsigned int x;
 
-			if (y >= box_y && y < (box_y + box_height)) {
-				color.y = 255 - color.y;
-				color.u = 255 - color.u;
-				color.v = 255 - color.v;
-			}
+	for (x = 0; x < width; x++) {
+		unsigned int index = x / color_width;
+		struct nv12_color color;
 
-			*l++ = color.y;
+		if (index >= colors_count)
+			index = colors_count - 1;
 
-			/* YUV 420 */
-			if (!(y % 2) && !(x % 2)) {
-				*c++ = color.u;
-				*c++ = color.v;
-			}
+		color = colors[index];
 
-			/* YUV 422 */
-/*
-			if (!(x % 2)) {
-				*c++ = color.u;
-				*c++ = color.v;
-			}
-*/
+		if (inverted) {
+			color.y = 255 - color.y;
+			color.u = 255 - color.u;
+			color.v = 255 - color.v;
 		}
 
-		if (stride - width > 0) {
-			l += stride - width;
-			c += stride - width;
+		*l++ = color.y;
+
+		/* YUV 420 */
+		if (!(y % 2) && !(x % 2)) {
+			*c++ = color.u;
+			*c++ = color.v;
 		}
 	}
 }
 
+static void test_pattern_rows(unsigned int height, struct draw_region *region,
+			      unsigned int *y_start, unsigned int *y_stop)
+{
+	*y_start = 0;
+	*y_stop = height;
+
+	/* Only regenerate the rows covered by the region, chroma-aligned. */
+	if (region) {
+		*y_start = region->y & ~1;
+		*y_stop = (region->y + region->height + 1) & ~1;
+
+		if (*y_stop > height)
+			*y_stop = height;
+	}
+}
+
+void test_pattern_step(unsigned int width, unsigned int height, unsigned int stride, unsigned int step, void *luma, void *chroma, struct draw_region *region)
+{
+	struct draw_region box;
+	unsigned int y_start, y_stop;
+	unsigned int y;
+
+	test_pattern_box(width, height, step, &box);
+	test_pattern_rows(height, region, &y_start, &y_stop);
+
+	for (y = y_start; y < y_stop; y++)
+		test_pattern_line(width, y, &box, luma + y * stride,
+				  chroma + (y / 2) * stride);
+}
+
+/*
+ * Rows are generated in a cached scratch line of twice the width and
+ * flushed with wide stores, for destinations mapped write-combined or
+ * uncached.
+ */
+void test_pattern_step_staged(unsigned int width, unsigned int height,
+			      unsigned int stride, unsigned int step,
+			      void *luma, void *chroma,
+			      struct draw_region *region, void *scratch)
+{
+	struct draw_region box;
+	unsigned int y_start, y_stop;
+	unsigned int y;
+	unsigned char *line = scratch;
+
+	test_pattern_box(width, height, step, &box);
+	test_pattern_rows(height, region, &y_start, &y_stop);
+
+	for (y = y_start; y < y_stop; y++) {
+		test_pattern_line(width, y, &box, line, line + width);
+
+		copy_stream(luma + y * stride, line, width);
+
+		if (!(y % 2))
+			copy_stream(chroma + (y / 2) * stride, line + width,
+				    width);
+	}
+}
+
 struct rgb_color {
 	unsigned int r;
 	unsigned int g;
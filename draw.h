@@ -5,13 +5,44 @@
 #ifndef _DRAW_H_
 #define _DRAW_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+enum draw_buffer_flags {
+	DRAW_BUFFER_ALIGNED = (1 << 0),
+	DRAW_BUFFER_HUGEPAGES = (1 << 1),
+	DRAW_BUFFER_POPULATE = (1 << 2),
+};
+
 struct draw_buffer {
 	void *data;
 	unsigned int size;
 
+	/* Allocation */
+	unsigned int flags;
+	size_t map_size;
+	bool hugetlb;
+
 	unsigned int width;
 	unsigned int height;
 	unsigned int stride;
+
+	/* Shared buffers only, private buffers have no references. */
+	unsigned int references;
+	struct draw_buffer *next;
+	pthread_t thread;
+
+	/* Last user to draw into the buffer. */
+	const void *owner;
+};
+
+struct draw_region {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
 };
 
 struct draw_mandelbrot {
@@ -36,8 +67,34 @@ static inline uint32_t *draw_buffer_pixel(struct draw_buffer *buffer,
 	return (uint32_t *)(buffer->data + offset);
 }
 
-struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height);
+static inline void draw_region_union(struct draw_region *region,
+				     struct draw_region *other)
+{
+	unsigned int x_stop = region->x + region->width;
+	unsigned int y_stop = region->y + region->height;
+
+	if (other->x + other->width > x_stop)
+		x_stop = other->x + other->width;
+
+	if (other->y + other->height > y_stop)
+		y_stop = other->y + other->height;
+
+	if (other->x < region->x)
+		region->x = other->x;
+
+	if (other->y < region->y)
+		region->y = other->y;
+
+	region->width = x_stop - region->x;
+	region->height = y_stop - region->y;
+}
+
+struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height,
+				       unsigned int flags);
 void draw_buffer_destroy(struct draw_buffer *buffer);
+struct draw_buffer *draw_buffer_get(unsigned int width, unsigned int height,
+				    unsigned int flags);
+void draw_buffer_put(struct draw_buffer *buffer);
 void draw_png(struct draw_buffer *buffer, char *path);
 void draw_gradient(struct draw_buffer *buffer);
 void draw_background(struct draw_buffer *buffer, uint32_t color);
@@ -49,6 +106,12 @@ void draw_mandelbrot(struct draw_mandelbrot *mandelbrot,
 void draw_mandelbrot_zoom(struct draw_mandelbrot *mandelbrot);
 void draw_mandelbrot_init(struct draw_mandelbrot *mandelbrot);
 
-void test_pattern_step(unsigned int width, unsigned int height, unsigned int stride, unsigned int step, void *luma, void *chroma);
+void test_pattern_box(unsigned int width, unsigned int height,
+		      unsigned int step, struct draw_region *region);
+void test_pattern_step(unsigned int width, unsigned int height, unsigned int stride, unsigned int step, void *luma, void *chroma, struct draw_region *region);
+void test_pattern_step_staged(unsigned int width, unsigned int height,
+			      unsigned int stride, unsigned int step,
+			      void *luma, void *chroma,
+			      struct draw_region *region, void *scratch);
 
 #endif
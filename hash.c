@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#include <string.h>
+
+#include <hash.h>
+
+/*
+ * Fast non-cryptographic hash following the XXH3 long-input layout: four
+ * 64-bit lanes accumulate 32-bit by 32-bit products of each stripe, which
+ * maps to generic vectors and vector multiply-long instructions.
+ */
+
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+#define HASH_STRIPE		32
+
+#define HASH_PRIME32_1		0x9e3779b1ULL
+#define HASH_PRIME32_2		0x85ebca77ULL
+#define HASH_PRIME32_3		0xc2b2ae3dULL
+#define HASH_PRIME64_1		0x9e3779b185ebca87ULL
+#define HASH_PRIME64_2		0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME64_3		0x165667b19e3779f9ULL
+#define HASH_PRIME64_4		0x85ebca77c2b2ae63ULL
+#define HASH_PRIME64_5		0x27d4eb2f165667c5ULL
+
+static inline uint64_t hash_rotl(uint64_t value, unsigned int shift)
+{
+	return (value << shift) | (value >> (64 - shift));
+}
+
+static inline uint64_t hash_avalanche(uint64_t hash)
+{
+	hash ^= hash >> 33;
+	hash *= HASH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= HASH_PRIME64_3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+uint64_t hash64(const void *data, size_t size, uint64_t seed)
+{
+	const uint8_t *bytes = data;
+	v4u64 accumulator = { HASH_PRIME32_3, HASH_PRIME64_1, HASH_PRIME64_2,
+			      HASH_PRIME64_3 };
+	v4u64 key = { HASH_PRIME64_4 + seed, HASH_PRIME64_5 - seed,
+		      HASH_PRIME32_1 + seed, HASH_PRIME32_2 - seed };
+	v4u64 swap = { 1, 0, 3, 2 };
+	uint64_t hash = seed + size * HASH_PRIME64_1;
+	size_t offset;
+	unsigned int i;
+
+	for (offset = 0; offset + HASH_STRIPE <= size; offset += HASH_STRIPE) {
+		v4u64 input, mixed;
+
+		memcpy(&input, bytes + offset, sizeof(input));
+
+		mixed = input ^ key;
+		accumulator += (mixed & 0xffffffff) * (mixed >> 32);
+		accumulator += __builtin_shuffle(input, swap);
+	}
+
+	for (i = 0; i < 4; i++) {
+		hash ^= hash_avalanche(accumulator[i]);
+		hash = hash_rotl(hash, 27) * HASH_PRIME64_1 + HASH_PRIME64_4;
+	}
+
+	for (; offset < size; offset++) {
+		hash ^= bytes[offset] * HASH_PRIME64_5;
+		hash = hash_rotl(hash, 11) * HASH_PRIME64_1;
+	}
+
+	return hash_avalanche(hash);
+}
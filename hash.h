@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t hash64(const void *data, size_t size, uint64_t seed);
+
+#endif
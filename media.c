@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -16,6 +17,7 @@
 
 #include <linux/media.h>
 
+#include <media.h>
 #include <v4l2.h>
 
 int media_device_info(int media_fd, struct media_device_info *device_info)
@@ -40,6 +42,95 @@ int media_topology_get(int media_fd, struct media_v2_topology *topology)
 	return 0;
 }
 
+static int media_topology_arrays_alloc(struct media_v2_topology *topology)
+{
+	void *interfaces, *entities, *pads, *links;
+
+	interfaces = calloc(topology->num_interfaces,
+			    sizeof(struct media_v2_interface));
+	entities = calloc(topology->num_entities,
+			  sizeof(struct media_v2_entity));
+	pads = calloc(topology->num_pads, sizeof(struct media_v2_pad));
+	links = calloc(topology->num_links, sizeof(struct media_v2_link));
+
+	topology->ptr_interfaces = (__u64)(uintptr_t)interfaces;
+	topology->ptr_entities = (__u64)(uintptr_t)entities;
+	topology->ptr_pads = (__u64)(uintptr_t)pads;
+	topology->ptr_links = (__u64)(uintptr_t)links;
+
+	if (!interfaces || !entities || !pads || !links) {
+		media_topology_release(topology);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Arrays are preallocated with the given capacity so that a single ioctl is
+ * enough in the common case, falling back to querying the counts first.
+ */
+int media_topology_fetch(int media_fd, struct media_v2_topology *topology,
+			 unsigned int capacity)
+{
+	int ret;
+
+	if (!topology)
+		return -EINVAL;
+
+	memset(topology, 0, sizeof(*topology));
+
+	if (capacity) {
+		topology->num_interfaces = capacity;
+		topology->num_entities = capacity;
+		topology->num_pads = capacity;
+		topology->num_links = capacity;
+
+		ret = media_topology_arrays_alloc(topology);
+		if (ret)
+			return ret;
+
+		ret = media_topology_get(media_fd, topology);
+		if (ret != -ENOSPC)
+			goto complete;
+
+		media_topology_release(topology);
+	}
+
+	ret = media_topology_get(media_fd, topology);
+	if (ret)
+		return ret;
+
+	if (!topology->num_interfaces || !topology->num_entities ||
+	    !topology->num_pads || !topology->num_links)
+		return -ENODEV;
+
+	ret = media_topology_arrays_alloc(topology);
+	if (ret)
+		return ret;
+
+	ret = media_topology_get(media_fd, topology);
+
+complete:
+	if (ret)
+		media_topology_release(topology);
+
+	return ret;
+}
+
+void media_topology_release(struct media_v2_topology *topology)
+{
+	if (!topology)
+		return;
+
+	free((void *)(uintptr_t)topology->ptr_interfaces);
+	free((void *)(uintptr_t)topology->ptr_entities);
+	free((void *)(uintptr_t)topology->ptr_pads);
+	free((void *)(uintptr_t)topology->ptr_links);
+
+	memset(topology, 0, sizeof(*topology));
+}
+
 struct media_v2_entity *media_topology_entity_find_by_function(struct media_v2_topology *topology,
 							       unsigned int function)
 {
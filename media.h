@@ -11,6 +11,9 @@
 
 int media_device_info(int media_fd, struct media_device_info *device_info);
 int media_topology_get(int media_fd, struct media_v2_topology *topology);
+int media_topology_fetch(int media_fd, struct media_v2_topology *topology,
+			 unsigned int capacity);
+void media_topology_release(struct media_v2_topology *topology);
 struct media_v2_entity *media_topology_entity_find_by_function(struct media_v2_topology *topology,
 							       unsigned int function);
 struct media_v2_interface *media_topology_interface_find_by_id(struct media_v2_topology *topology,
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <rate-control.h>
+
+int rate_control_init(struct rate_control *rate_control, unsigned int mode,
+		      unsigned int bitrate, unsigned int vbv_size,
+		      unsigned int fps_num, unsigned int fps_den,
+		      unsigned int qp)
+{
+	if (!rate_control || !bitrate || !fps_num || !fps_den)
+		return -EINVAL;
+
+	memset(rate_control, 0, sizeof(*rate_control));
+
+	rate_control->mode = mode;
+	rate_control->bitrate = bitrate;
+
+	rate_control->qp = qp;
+	rate_control->qp_base = qp;
+	rate_control->qp_min = 10;
+	rate_control->qp_max = 51;
+
+	/* The VBV buffer holds one second of data by default. */
+	rate_control->vbv_size = vbv_size ? vbv_size : bitrate;
+	rate_control->frame_bits = (int64_t)bitrate * fps_den / fps_num;
+	rate_control->vbv_fullness = rate_control->vbv_size / 2;
+
+	return 0;
+}
+
+void rate_control_update(struct rate_control *rate_control,
+			 unsigned int bytes)
+{
+	int64_t fullness, size;
+	int delta = 0;
+	int qp;
+
+	if (!rate_control || !rate_control->mode)
+		return;
+
+	/* The buffer fills with coded frames and drains at the target rate. */
+	fullness = rate_control->vbv_fullness + (int64_t)bytes * 8 -
+		   rate_control->frame_bits;
+	size = rate_control->vbv_size;
+
+	if (fullness < 0)
+		fullness = 0;
+	else if (fullness > size)
+		fullness = size;
+
+	rate_control->vbv_fullness = fullness;
+
+	switch (rate_control->mode) {
+	case RATE_CONTROL_MODE_CBR:
+		/* Keep the buffer half-full, reacting harder further away. */
+		if (fullness > size * 7 / 8)
+			delta = 2;
+		else if (fullness > size * 5 / 8)
+			delta = 1;
+		else if (fullness < size / 8)
+			delta = -2;
+		else if (fullness < size * 3 / 8)
+			delta = -1;
+		break;
+	case RATE_CONTROL_MODE_VBR:
+		/* Only spend less than the base quality when overflowing. */
+		if (fullness > size * 3 / 4)
+			delta = 1;
+		else if (fullness < size / 4 &&
+			 rate_control->qp > rate_control->qp_base)
+			delta = -1;
+		break;
+	}
+
+	qp = (int)rate_control->qp + delta;
+
+	if (qp < (int)rate_control->qp_min)
+		qp = rate_control->qp_min;
+	else if (qp > (int)rate_control->qp_max)
+		qp = rate_control->qp_max;
+
+	rate_control->qp = qp;
+}
+
+unsigned int rate_control_qp(struct rate_control *rate_control)
+{
+	if (!rate_control)
+		return 0;
+
+	return rate_control->qp;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#ifndef _RATE_CONTROL_H_
+#define _RATE_CONTROL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum rate_control_mode {
+	RATE_CONTROL_MODE_NONE = 0,
+	RATE_CONTROL_MODE_CBR,
+	RATE_CONTROL_MODE_VBR,
+};
+
+struct rate_control {
+	unsigned int mode;
+	unsigned int bitrate;
+
+	/* Quantization */
+	unsigned int qp;
+	unsigned int qp_base;
+	unsigned int qp_min;
+	unsigned int qp_max;
+
+	/* VBV buffer model, in bits */
+	int64_t vbv_size;
+	int64_t vbv_fullness;
+	int64_t frame_bits;
+};
+
+int rate_control_init(struct rate_control *rate_control, unsigned int mode,
+		      unsigned int bitrate, unsigned int vbv_size,
+		      unsigned int fps_num, unsigned int fps_den,
+		      unsigned int qp);
+void rate_control_update(struct rate_control *rate_control,
+			 unsigned int bytes);
+unsigned int rate_control_qp(struct rate_control *rate_control);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <sys/mman.h>
+
+#include <realtime.h>
+
+/* Pins the calling thread to a CPU list such as "1,3-4". */
+int realtime_affinity(const char *cpus)
+{
+	cpu_set_t set;
+	const char *list = cpus;
+	char *end;
+	int ret;
+
+	if (!cpus)
+		return -EINVAL;
+
+	CPU_ZERO(&set);
+
+	while (*list) {
+		unsigned long first, last;
+
+		first = strtoul(list, &end, 10);
+		if (end == list)
+			return -EINVAL;
+
+		last = first;
+		list = end;
+
+		if (*list == '-') {
+			list++;
+
+			last = strtoul(list, &end, 10);
+			if (end == list || last < first)
+				return -EINVAL;
+
+			list = end;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (; first <= last; first++)
+			CPU_SET(first, &set);
+
+		if (*list == ',')
+			list++;
+		else if (*list)
+			return -EINVAL;
+	}
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret)
+		return -ret;
+
+	printf("Pinned to CPUs %s\n", cpus);
+
+	return 0;
+}
+
+int realtime_scheduler(unsigned int priority)
+{
+	struct sched_param param = { 0 };
+	int min, max;
+	int ret;
+
+	min = sched_get_priority_min(SCHED_FIFO);
+	max = sched_get_priority_max(SCHED_FIFO);
+
+	if ((int)priority < min || (int)priority > max)
+		return -EINVAL;
+
+	param.sched_priority = priority;
+
+	ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (ret)
+		return -ret;
+
+	printf("Running with SCHED_FIFO priority %u\n", priority);
+
+	return 0;
+}
+
+/* Mappings and allocations made from now on are locked as well. */
+int realtime_memory_lock(void)
+{
+	int ret;
+
+	ret = mlockall(MCL_CURRENT | MCL_FUTURE);
+	if (ret)
+		return -errno;
+
+	printf("Memory locked\n");
+
+	return 0;
+}
@@ -0,0 +1,12 @@
+/*
+ * Copyright (C) 2023 Bootlin
+ */
+
+#ifndef _REALTIME_H_
+#define _REALTIME_H_
+
+int realtime_affinity(const char *cpus);
+int realtime_scheduler(unsigned int priority);
+int realtime_memory_lock(void);
+
+#endif
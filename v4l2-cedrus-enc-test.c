@@ -5,7 +5,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -17,6 +19,60 @@
 
 #include <v4l2.h>
 #include <v4l2-encoder.h>
+#include <csc.h>
+#include <control.h>
+#include <realtime.h>
+#include <bench.h>
+
+static const char *sources[] = {
+	[V4L2_ENCODER_SOURCE_PATTERN] = "pattern",
+	[V4L2_ENCODER_SOURCE_PATTERN_PNG] = "png",
+	[V4L2_ENCODER_SOURCE_GRADIENT] = "gradient",
+	[V4L2_ENCODER_SOURCE_RECTANGLE] = "rectangle",
+	[V4L2_ENCODER_SOURCE_MANDELBROT] = "mandelbrot",
+	[V4L2_ENCODER_SOURCE_FILE] = "file",
+};
+
+static void usage(const char *name)
+{
+	unsigned int i;
+
+	printf("Usage: %s [options]\n", name);
+	printf("Options:\n");
+	printf(" -f [frames]   number of frames to encode\n");
+	printf(" -s [source]   frame source:");
+
+	for (i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+		printf(" %s", sources[i]);
+
+	printf("\n");
+	printf(" -i [path]     raw input file for the file source\n");
+	printf(" -F [fourcc]   pixel format of the raw input file\n");
+	printf(" -p [count]    pre-render frames to benchmark the encoder alone\n");
+	printf(" -b [bitrate]  target bitrate in bit/s\n");
+	printf(" -r [mode]     rate control mode: cbr vbr\n");
+	printf(" -v [size]     rate control VBV buffer size in bits\n");
+	printf(" -a            content-adaptive QP from frame analysis\n");
+	printf(" -c            force keyframes on detected scene cuts\n");
+	printf(" -d            skip encoding of duplicate frames\n");
+	printf(" -k [path]     control socket accepting keyframe requests\n");
+	printf(" -K [ms]       minimum interval between requested keyframes\n");
+	printf(" -R [WxH]      switch to another resolution halfway\n");
+	printf(" -M [path]     encoder media device, skipping discovery\n");
+	printf(" -D [path]     encoder video device, used with -M\n");
+	printf(" -C [path]     device discovery cache file\n");
+	printf(" -A [flags]    draw buffer allocation: aligned,hugepages,populate\n");
+	printf(" -W            stage writes and reads of write-combined buffers\n");
+	printf(" -w            pre-fault buffers and warm up the encoder\n");
+	printf(" -T [fps]      pace frames in real time at the framerate\n");
+	printf(" -X            drop frames when falling behind the pace\n");
+	printf(" -P [cpus]     pin the encoding thread to a CPU list\n");
+	printf(" -S [priority] run the encoding thread with SCHED_FIFO\n");
+	printf(" -L            lock memory after setup\n");
+	printf(" -B            benchmark drawing and conversion on malloc'd and device\n");
+	printf("               buffers, then exit\n");
+	printf(" -h            show this help\n");
+}
 
 int main(int argc, char *argv[])
 {
@@ -24,15 +80,196 @@ int main(int argc, char *argv[])
 	unsigned int width = 1920;
 	unsigned int height = 1080;
 	unsigned int frames = 3;
+	unsigned int source = V4L2_ENCODER_SOURCE_PATTERN;
+	unsigned int prerender = 0;
+	unsigned int rc_mode = RATE_CONTROL_MODE_NONE;
+	unsigned int bitrate = 0;
+	unsigned int vbv_size = 0;
+	bool adaptive_qp = false;
+	bool scene_cut = false;
+	bool skip_duplicates = false;
+	struct control control = { .fd = -1 };
+	char *control_path = NULL;
+	int keyframe_interval = -1;
+	unsigned int keyframe_requests;
+	unsigned int reconfigure_width = 0;
+	unsigned int reconfigure_height = 0;
+	unsigned int reconfigure_frame;
+	char *media_path = NULL;
+	char *video_path = NULL;
+	char *cache_path = NULL;
+	unsigned int draw_buffer_flags = 0;
+	bool staging = false;
+	bool warmup = false;
+	char *realtime_cpus = NULL;
+	unsigned int realtime_priority = 0;
+	bool memory_lock = false;
+	float pacing_fps = 0;
+	bool pacing_drop = false;
+	bool bench = false;
+	char *flag;
+	char *source_path = NULL;
+	uint32_t source_format = 0;
+	unsigned int i;
+	int opt;
 	int ret;
 
+	while ((opt = getopt(argc, argv, "f:s:i:F:p:b:r:v:acdk:K:R:M:D:C:A:WwP:S:LT:XBh")) != -1) {
+		switch (opt) {
+		case 'f':
+			frames = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			for (i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+				if (!strcmp(optarg, sources[i]))
+					break;
+
+			if (i == sizeof(sources) / sizeof(sources[0])) {
+				fprintf(stderr, "Unknown source %s\n", optarg);
+				return 1;
+			}
+
+			source = i;
+			break;
+		case 'i':
+			source_path = optarg;
+			source = V4L2_ENCODER_SOURCE_FILE;
+			break;
+		case 'F':
+			if (strlen(optarg) != 4) {
+				fprintf(stderr, "Invalid fourcc %s\n", optarg);
+				return 1;
+			}
+
+			source_format = v4l2_fourcc(optarg[0], optarg[1],
+						    optarg[2], optarg[3]);
+			break;
+		case 'p':
+			prerender = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			bitrate = strtoul(optarg, NULL, 10);
+
+			if (rc_mode == RATE_CONTROL_MODE_NONE)
+				rc_mode = RATE_CONTROL_MODE_CBR;
+			break;
+		case 'r':
+			if (!strcmp(optarg, "cbr")) {
+				rc_mode = RATE_CONTROL_MODE_CBR;
+			} else if (!strcmp(optarg, "vbr")) {
+				rc_mode = RATE_CONTROL_MODE_VBR;
+			} else {
+				fprintf(stderr, "Unknown rate control %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'v':
+			vbv_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			adaptive_qp = true;
+			break;
+		case 'c':
+			scene_cut = true;
+			break;
+		case 'd':
+			skip_duplicates = true;
+			break;
+		case 'k':
+			control_path = optarg;
+			break;
+		case 'K':
+			keyframe_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'R':
+			if (sscanf(optarg, "%ux%u", &reconfigure_width,
+				   &reconfigure_height) != 2) {
+				fprintf(stderr, "Invalid resolution %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'M':
+			media_path = optarg;
+			break;
+		case 'D':
+			video_path = optarg;
+			break;
+		case 'C':
+			cache_path = optarg;
+			break;
+		case 'A':
+			for (flag = strtok(optarg, ","); flag;
+			     flag = strtok(NULL, ",")) {
+				if (!strcmp(flag, "aligned")) {
+					draw_buffer_flags |= DRAW_BUFFER_ALIGNED;
+				} else if (!strcmp(flag, "hugepages")) {
+					draw_buffer_flags |= DRAW_BUFFER_HUGEPAGES;
+				} else if (!strcmp(flag, "populate")) {
+					draw_buffer_flags |= DRAW_BUFFER_POPULATE;
+				} else {
+					fprintf(stderr, "Unknown allocation flag %s\n",
+						flag);
+					return 1;
+				}
+			}
+			break;
+		case 'W':
+			staging = true;
+			break;
+		case 'w':
+			warmup = true;
+			break;
+		case 'P':
+			realtime_cpus = optarg;
+			break;
+		case 'S':
+			realtime_priority = strtoul(optarg, NULL, 10);
+			break;
+		case 'L':
+			memory_lock = true;
+			break;
+		case 'T':
+			pacing_fps = strtof(optarg, NULL);
+			break;
+		case 'X':
+			pacing_drop = true;
+			break;
+		case 'B':
+			bench = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* Memory from malloc is the baseline for the device buffers. */
+	if (bench && bench_run(width, height, frames))
+		return 1;
+
 	encoder = calloc(1, sizeof(*encoder));
 	if (!encoder)
 		goto error;
 
-	ret = v4l2_encoder_open(encoder);
-	if (ret)
+	if (media_path)
+		ret = v4l2_encoder_open_path(encoder, media_path, video_path);
+	else if (cache_path)
+		ret = v4l2_encoder_open_cached(encoder, cache_path);
+	else
+		ret = v4l2_encoder_open(encoder);
+
+	if (ret && bench) {
+		printf("\nNo encoder device, only malloc'd memory was benchmarked\n");
+		ret = 0;
+		goto complete;
+	} else if (ret) {
 		goto error;
+	}
 
 	ret = v4l2_encoder_probe(encoder);
 	if (ret)
@@ -46,15 +283,145 @@ int main(int argc, char *argv[])
 	if (ret)
 		return ret;
 
+	ret = v4l2_encoder_setup_source(encoder, source);
+	if (ret)
+		goto error;
+
+	if (source_path) {
+		ret = v4l2_encoder_setup_source_path(encoder, source_path);
+		if (ret)
+			goto error;
+	}
+
+	ret = v4l2_encoder_setup_source_format(encoder, source_format);
+	if (ret)
+		goto error;
+
+	ret = v4l2_encoder_setup_draw_buffer_flags(encoder, draw_buffer_flags);
+	if (ret)
+		goto error;
+
+	ret = v4l2_encoder_setup_prerender(encoder, prerender);
+	if (ret)
+		goto error;
+
+	if (rc_mode) {
+		ret = v4l2_encoder_setup_bitrate(encoder, rc_mode, bitrate,
+						 vbv_size);
+		if (ret)
+			goto error;
+	}
+
+	ret = v4l2_encoder_setup_adaptive_qp(encoder, adaptive_qp);
+	if (ret)
+		goto error;
+
+	ret = v4l2_encoder_setup_scene_cut(encoder, scene_cut);
+	if (ret)
+		goto error;
+
+	ret = v4l2_encoder_setup_skip_duplicates(encoder, skip_duplicates);
+	if (ret)
+		goto error;
+
+	ret = v4l2_encoder_setup_staging(encoder, staging);
+	if (ret)
+		goto error;
+
+	ret = v4l2_encoder_setup_warmup(encoder, warmup);
+	if (ret)
+		goto error;
+
+	if (pacing_fps > 0) {
+		ret = v4l2_encoder_setup_fps(encoder, pacing_fps);
+		if (ret)
+			goto error;
+
+		ret = v4l2_encoder_setup_pacing(encoder, true, pacing_drop);
+		if (ret)
+			goto error;
+	}
+
+	if (keyframe_interval >= 0) {
+		ret = v4l2_encoder_setup_keyframe_interval(encoder,
+							   keyframe_interval);
+		if (ret)
+			goto error;
+	}
+
 	ret = v4l2_encoder_setup(encoder);
 	if (ret)
 		goto error;
 
+	if (bench) {
+		ret = v4l2_encoder_bench(encoder, frames);
+		if (ret)
+			goto error;
+
+		ret = 0;
+		goto complete;
+	}
+
+	/* The encoding loop runs in this thread, there are no workers. */
+	if (realtime_cpus) {
+		ret = realtime_affinity(realtime_cpus);
+		if (ret) {
+			fprintf(stderr, "Failed to set CPU affinity\n");
+			goto error;
+		}
+	}
+
+	if (realtime_priority) {
+		ret = realtime_scheduler(realtime_priority);
+		if (ret) {
+			fprintf(stderr, "Failed to set real-time scheduling\n");
+			goto error;
+		}
+	}
+
+	/* All buffers are mapped and allocated by now. */
+	if (memory_lock) {
+		ret = realtime_memory_lock();
+		if (ret) {
+			fprintf(stderr, "Failed to lock memory\n");
+			goto error;
+		}
+	}
+
 	ret = v4l2_encoder_start(encoder);
 	if (ret)
 		goto error;
 
+	if (control_path) {
+		ret = control_open(&control, control_path);
+		if (ret) {
+			fprintf(stderr, "Failed to open control socket\n");
+			goto error;
+		}
+	}
+
+	reconfigure_frame = frames / 2;
+
 	while (frames--) {
+		if (reconfigure_width && frames == reconfigure_frame) {
+			ret = v4l2_encoder_reconfigure(encoder,
+						       reconfigure_width,
+						       reconfigure_height, 0);
+			if (ret)
+				goto error;
+		}
+
+		if (control.fd >= 0) {
+			ret = control_poll(&control, &keyframe_requests);
+			if (!ret)
+				while (keyframe_requests--)
+					v4l2_encoder_request_keyframe(encoder);
+		}
+
+		ret = v4l2_encoder_pace(encoder);
+		if (ret)
+			goto error;
+
 		ret = v4l2_encoder_prepare(encoder);
 		if (ret)
 			goto error;
@@ -68,6 +435,8 @@ int main(int argc, char *argv[])
 			goto error;
 	}
 
+	v4l2_encoder_stats_report(encoder);
+
 	ret = 0;
 	goto complete;
 
@@ -75,6 +444,8 @@ error:
 	ret = 1;
 
 complete:
+	control_close(&control);
+
 	if (encoder) {
 		v4l2_encoder_stop(encoder);
 		v4l2_encoder_cleanup(encoder);
@@ -8,10 +8,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <libudev.h>
 
@@ -22,20 +24,164 @@
 #include <v4l2.h>
 #include <v4l2-encoder.h>
 #include <csc.h>
+#include <hash.h>
+#include <copy.h>
+#include <bench.h>
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
 
+#define V4L2_ENCODER_CAPTURE_BUFFERS	3
+
+/* Watchdog deadline bounds and frames measured before adapting, in us. */
+#define V4L2_ENCODER_WATCHDOG_MIN	5000
+#define V4L2_ENCODER_WATCHDOG_MAX	300000
+#define V4L2_ENCODER_WATCHDOG_FRAMES	8
+
+/* Pacing lateness tolerated as a fraction of the period, for wakeups. */
+#define V4L2_ENCODER_PACING_TOLERANCE	8
+
+static int v4l2_encoder_capture_grow(struct v4l2_encoder *encoder);
+
+#define timespec_diff(tb, ta) \
+       ((ta.tv_sec * 1000000000UL + ta.tv_nsec) - (tb.tv_sec * 1000000000UL + tb.tv_nsec))
+
+static uint64_t v4l2_encoder_time(void)
+{
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static void v4l2_encoder_jitter_update(struct v4l2_encoder_jitter *jitter,
+				       uint64_t value)
+{
+	if (!jitter->count || value < jitter->min)
+		jitter->min = value;
+
+	if (value > jitter->max)
+		jitter->max = value;
+
+	jitter->count++;
+	jitter->total += value;
+	jitter->squares += (double)value * value;
+}
+
+static void v4l2_encoder_jitter_stats(struct v4l2_encoder_jitter *jitter,
+				      double *mean, double *deviation)
+{
+	*mean = (double)jitter->total / jitter->count;
+	*deviation = sqrt(fmax(jitter->squares / jitter->count -
+			       *mean * *mean, 0.));
+}
+
+static void v4l2_encoder_jitter_report(const char *name,
+				       struct v4l2_encoder_jitter *jitter)
+{
+	double mean, deviation;
+
+	if (!jitter->count)
+		return;
+
+	v4l2_encoder_jitter_stats(jitter, &mean, &deviation);
+
+	printf("%s: mean %.3f ms, stddev %.3f ms, min %.3f ms, max %.3f ms\n",
+	       name, mean / 1000000., deviation / 1000000.,
+	       jitter->min / 1000000., jitter->max / 1000000.);
+}
+
+void v4l2_encoder_stats_report(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_stats *stats;
+	unsigned int capture_size;
+	double seconds;
+
+	if (!encoder)
+		return;
+
+	stats = &encoder->stats;
+
+	if (!stats->frames || !stats->encode_time)
+		return;
+
+	seconds = stats->encode_time / 1000000000.;
+
+	printf("Encoded %u frames in %.3f s of encode time\n", stats->frames,
+	       seconds);
+	printf("Throughput: %.2f frames/s, %.2f MB/s picture, %.2f MB/s coded\n",
+	       stats->frames / seconds,
+	       stats->output_bytes / seconds / 1000000.,
+	       stats->coded_bytes / seconds / 1000000.);
+
+	if (encoder->setup.fps_den)
+		printf("Average bitrate: %.0f kbit/s at %.2f fps\n",
+		       stats->coded_bytes * 8. / stats->frames *
+		       encoder->setup.fps_num / encoder->setup.fps_den / 1000.,
+		       (double)encoder->setup.fps_num / encoder->setup.fps_den);
+
+	v4l2_encoder_jitter_report("Encode time", &stats->encode_jitter);
+	v4l2_encoder_jitter_report("Frame interval", &stats->interval_jitter);
+	v4l2_encoder_jitter_report("Glass-to-bitstream latency",
+				   &stats->latency_jitter);
+
+	printf("Time to first frame: %.1f ms from open, %.1f ms from start\n",
+	       stats->first_frame_time / 1000000.,
+	       stats->start_frame_time / 1000000.);
+
+	if (stats->slow || stats->hangs)
+		printf("Watchdog: %u slow frames, %u hangs recovered\n",
+		       stats->slow, stats->hangs);
+
+	if (encoder->setup.pacing)
+		printf("Pacing: %u late frames, %u dropped frames\n",
+		       stats->late, stats->dropped);
+
+	if (encoder->setup.warmup)
+		printf("Warm-up encode took %.1f ms\n",
+		       stats->warmup_time / 1000000.);
+
+	v4l2_format_sizeimage(&encoder->capture_format, 0, &capture_size);
+
+	printf("Coded buffer high-water mark: %u of %u bytes, grown %u times\n",
+	       stats->coded_high_water, capture_size, stats->coded_growths);
+
+	if (encoder->setup.scene_cut)
+		printf("Scene cuts: %u\n", stats->scene_cuts);
+
+	if (encoder->setup.skip_duplicates)
+		printf("Skipped duplicate frames: %u\n", stats->skipped);
+
+	if (encoder->output_non_coherent)
+		printf("Picture cache cleans skipped: %u\n",
+		       stats->cache_cleans_skipped);
+
+	if (atomic_load(&encoder->keyframe_requests))
+		printf("Keyframe requests: %u, served with %u keyframes\n",
+		       atomic_load(&encoder->keyframe_requests),
+		       stats->keyframes_requested);
+}
+
 int v4l2_encoder_complete(struct v4l2_encoder *encoder)
 {
 	struct v4l2_encoder_buffer *buffer;
 	unsigned int index;
 	unsigned int length;
+	unsigned int capacity;
+	struct timespec time;
 	char frame_type;
 	int ret;
 
 	if (!encoder)
 		return -EINVAL;
 
+	/* Nothing is emitted, the timestamp gap marks the repeat. */
+	if (encoder->frame_skip) {
+		encoder->stats.skipped++;
+		encoder->frame_number++;
+		return 0;
+	}
+
 	index = encoder->capture_returned_index;
 	buffer = &encoder->capture_buffers[index];
 
@@ -54,508 +200,2843 @@ int v4l2_encoder_complete(struct v4l2_encoder *encoder)
 	else
 		printf("Encoded %c frame in %u bytes\n", frame_type, length);
 
-	if (encoder->bitstream_fd >= 0 && length > 0)
-		write(encoder->bitstream_fd, buffer->mmap_data[0], length);
+	if (encoder->bitstream_fd >= 0 && length > 0) {
+		void *data = buffer->mmap_data[0];
 
-	encoder->frame_number++;
+		/* Read the coded buffer once in bulk rather than piecemeal. */
+		if (encoder->setup.staging) {
+			if (length > encoder->coded_data_size) {
+				void *coded_data;
 
-	return 0;
-}
+				coded_data = realloc(encoder->coded_data,
+						     length);
+				if (!coded_data)
+					return -ENOMEM;
 
-int v4l2_encoder_prepare(struct v4l2_encoder *encoder)
-{
-	struct v4l2_encoder_buffer *output_buffer;
-	unsigned int output_index;
-	unsigned int width, height;
-	const unsigned int pattern_step = 0;
-	int pixelformat;
-	int fd;
-	int ret;
+				encoder->coded_data = coded_data;
+				encoder->coded_data_size = length;
+			}
 
-	if (!encoder)
-		return -EINVAL;
+			copy_prefetch(encoder->coded_data, data, length);
+			data = encoder->coded_data;
+		}
 
-	v4l2_format_pixel(&encoder->output_format, &width, &height,
-			  &pixelformat);
+		write(encoder->bitstream_fd, data, length);
+	}
 
-	output_index = encoder->output_buffers_index;
-	output_buffer = &encoder->output_buffers[output_index];
+	clock_gettime(CLOCK_MONOTONIC, &time);
 
-#define PATTERN
+	/* From capture until the coded frame is handed over. */
+	if (encoder->frame_returned) {
+		uint64_t now = time.tv_sec * 1000000000ULL + time.tv_nsec;
+		uint64_t latency = now - encoder->frame_returned->timestamp;
 
-#ifdef MANDELBROT
-#define CONVERT_RGB_NV12
-	draw_mandelbrot_zoom(&encoder->draw_mandelbrot);
-	draw_mandelbrot(&encoder->draw_mandelbrot, encoder->draw_buffer);
-#endif
-#ifdef GRADIENT
-#define CONVERT_RGB_NV12
-	draw_gradient(encoder->draw_buffer);
-#endif
-#ifdef RECTANGLE
-#define CONVERT_RGB_NV12
-	draw_background(encoder->draw_buffer, 0xff00ffff);
-	draw_rectangle(encoder->draw_buffer, encoder->x, height / 3, width / 3,
-		       height / 3, 0x00ff0000);
-
-	if (!encoder->direction) {
-		if (encoder->x >= 20) {
-			encoder->x -= 20;
-		} else {
-			encoder->x = 0;
-			encoder->direction = 1;
-		}
-	} else {
-		if (encoder->x < (2 * width / 3 - 20)) {
-			encoder->x += 20;
-		} else {
-			encoder->x = 2 * width / 3;
-			encoder->direction = 0;
-		}
+		printf("Frame %u latency %llu us\n",
+		       encoder->frame_returned->frame_number,
+		       latency / 1000ULL);
+
+		v4l2_encoder_jitter_update(&encoder->stats.latency_jitter,
+					   latency);
+
+		encoder->frame_returned->used = false;
 	}
-#endif
-#ifdef PATTERN_PNG
-#define CONVERT_RGB_NV12
-	if (!encoder->pattern_drawn) {
-		draw_png(encoder->draw_buffer, "test-pattern.png");
-		encoder->pattern_drawn = true;
+
+	/* Startup cost as seen by a consumer, from opening the devices. */
+	if (!encoder->stats.frames) {
+		encoder->stats.first_frame_time =
+			timespec_diff(encoder->open_time, time);
+		encoder->stats.start_frame_time =
+			timespec_diff(encoder->start_time, time);
+	} else {
+		v4l2_encoder_jitter_update(&encoder->stats.interval_jitter,
+					   timespec_diff(encoder->complete_time,
+							 time));
 	}
-#endif
-#ifdef PATTERN
-	/* XXX: fixup stride. */
-	test_pattern_step(width, height, width, encoder->pattern_step, output_buffer->mmap_data[0], output_buffer->mmap_data[0] + width * height);
 
-	encoder->pattern_step++;
-#endif
+	encoder->complete_time = time;
 
-	printf("Drawing done\n");
+	encoder->stats.frames++;
+	encoder->stats.coded_bytes += length;
 
-#ifdef CONVERT_RGB_NV12
-	if (pixelformat == V4L2_PIX_FMT_YUV420M)
-		ret = rgb2yuv420(encoder->draw_buffer,
-				 output_buffer->mmap_data[0],
-				 output_buffer->mmap_data[1],
-				 output_buffer->mmap_data[2]);
-	else if (pixelformat == V4L2_PIX_FMT_NV12M)
-		ret = rgb2nv12(encoder->draw_buffer,
-			       output_buffer->mmap_data[0],
-			       output_buffer->mmap_data[1]);
-	else if (pixelformat == V4L2_PIX_FMT_NV12)
-		ret = rgb2nv12(encoder->draw_buffer,
-			       output_buffer->mmap_data[0],
-			       output_buffer->mmap_data[0] + width * height);
-#endif
+	/* Userspace rate control picks the QP of the next frame. */
+	if (encoder->setup.rc_mode && !encoder->rate_control_hardware &&
+	    !(buffer->buffer.flags & V4L2_BUF_FLAG_ERROR)) {
+		int qp_offset = (int)encoder->setup.qp_p -
+				(int)encoder->setup.qp_i;
+		int qp;
 
-#ifdef OUTPUT_DUMP
-	fd = open("output.yuv",  O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (fd < 0) {
-		printf("output open error!\n");
-		return -1;
+		rate_control_update(&encoder->rate_control, length);
+		qp = rate_control_qp(&encoder->rate_control);
+
+		v4l2_encoder_frame_qp(encoder,
+				      qp > qp_offset ? qp - qp_offset : 1, qp);
 	}
 
-	write(fd, output_buffer->mmap_data[0], width * height);
-	write(fd, output_buffer->mmap_data[1], width * height / 4);
-	write(fd, output_buffer->mmap_data[2], width * height / 4);
+	if (length > encoder->stats.coded_high_water)
+		encoder->stats.coded_high_water = length;
 
-	close(fd);
-#endif
+	/* Grow before a larger picture gets truncated. */
+	v4l2_buffer_plane_length(&buffer->buffer, 0, &capacity);
+
+	if (length > capacity / 10 * 9) {
+		ret = v4l2_encoder_capture_grow(encoder);
+		if (ret)
+			return ret;
+	}
+
+	encoder->frame_number++;
 
 	return 0;
 }
 
-#define timespec_diff(tb, ta) \
-       ((ta.tv_sec * 1000000000UL + ta.tv_nsec) - (tb.tv_sec * 1000000000UL + tb.tv_nsec))
+static uint32_t v4l2_encoder_source_format(struct v4l2_encoder *encoder)
+{
+	switch (encoder->setup.source) {
+	case V4L2_ENCODER_SOURCE_PATTERN:
+		return V4L2_PIX_FMT_NV12;
+	case V4L2_ENCODER_SOURCE_FILE:
+		if (encoder->setup.source_format)
+			return encoder->setup.source_format;
+
+		/* Raw files default to the output format, once known. */
+		if (!encoder->output_format.type)
+			return 0;
+
+		return v4l2_format_pixel_format(&encoder->output_format);
+	default:
+		return V4L2_PIX_FMT_XBGR32;
+	}
+}
 
-int v4l2_encoder_run(struct v4l2_encoder *encoder)
+static int v4l2_encoder_output_image(struct v4l2_encoder *encoder,
+				     void **planes, struct csc_image *image)
 {
-	struct v4l2_encoder_buffer *output_buffer;
-	unsigned int output_index;
-	struct v4l2_encoder_buffer *capture_buffer;
-	unsigned int capture_index;
-	struct v4l2_buffer buffer;
-	unsigned int frame_number = encoder->frame_number;
-	struct timespec time_before, time_after;
-	uint64_t time_diff;
-	uint64_t timestamp;
-	struct timeval timeout = { 0, 300000 };
-	unsigned int length = 0;
-	bool force_key_frame = false;
+	struct v4l2_format *format = &encoder->output_format;
+	unsigned int width, height;
+	unsigned int pixelformat;
+	unsigned int bytesperline = 0;
+	void *data;
+	unsigned int i;
 	int ret;
 
-	if (!encoder)
-		return -EINVAL;
+	v4l2_format_pixel(format, &width, &height, &pixelformat);
 
-	if (force_key_frame) {
-		ret = v4l2_encoder_control_set(encoder,
-					       V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME,
-					       0);
-		if (ret)
-			return ret;
+	ret = csc_image_setup(image, pixelformat, width, height, NULL);
+	if (ret < 0)
+		return ret;
+
+	/* Multi-planar formats have one V4L2 plane per image plane. */
+	if (v4l2_format_planes_count(format) > 1) {
+		for (i = 0; i < image->planes_count; i++) {
+			image->planes[i] = planes[i];
+
+			v4l2_format_bytesperline(format, i, &bytesperline);
+			if (bytesperline)
+				image->strides[i] = bytesperline;
+		}
+
+		return 0;
 	}
 
-	output_index = encoder->output_buffers_index;
-	output_buffer = &encoder->output_buffers[output_index];
+	/* Otherwise planes follow each other with the luma pitch. */
+	v4l2_format_bytesperline(format, 0, &bytesperline);
+	if (!bytesperline)
+		bytesperline = image->strides[0];
 
-	encoder->output_buffers_index++;
-	encoder->output_buffers_index %= encoder->output_buffers_count;
+	data = planes[0];
 
-	v4l2_buffer_plane_length(&output_buffer->buffer, 0, &length);
-	v4l2_buffer_setup_plane_length_used(&output_buffer->buffer, 0, length);
+	for (i = 0; i < image->planes_count; i++) {
+		unsigned int stride = bytesperline;
+		unsigned int rows = i ? height / 2 : height;
 
-	v4l2_buffer_setup_timestamp(&output_buffer->buffer,
-				    frame_number * 1000UL);
+		if (i && image->planes_count == 3)
+			stride /= 2;
 
-	printf("Queue picture frame %u in buffer %u\n", frame_number,
-	       output_index);
+		image->planes[i] = data;
+		image->strides[i] = stride;
+		image->sizes[i] = stride * rows;
 
-	ret = v4l2_buffer_queue(encoder->video_fd, &output_buffer->buffer);
-	if (ret)
-		return ret;
+		data += stride * rows;
+	}
 
-	capture_index = encoder->capture_buffers_index;
-	capture_buffer = &encoder->capture_buffers[capture_index];
+	return 0;
+}
 
-	encoder->capture_buffers_index++;
-	encoder->capture_buffers_index %= encoder->capture_buffers_count;
+static int v4l2_encoder_csc_convert(struct v4l2_encoder *encoder,
+				    struct csc_image *src,
+				    struct csc_image *dst,
+				    struct draw_region *region)
+{
+	if (encoder->setup.staging)
+		return csc_convert_staged(encoder->csc_kernel, src, dst,
+					  region, encoder->staging_data);
 
-	printf("Queue coded buffer %u\n", capture_index);
+	return csc_convert(encoder->csc_kernel, src, dst, region);
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &time_before);
+static int v4l2_encoder_convert(struct v4l2_encoder *encoder,
+				struct draw_region *region, void **planes)
+{
+	struct draw_buffer *buffer = encoder->draw_buffer;
+	struct csc_image src;
+	struct csc_image dst;
+	int ret;
 
-	ret = v4l2_buffer_queue(encoder->video_fd, &capture_buffer->buffer);
+	ret = v4l2_encoder_output_image(encoder, planes, &dst);
 	if (ret)
 		return ret;
 
+	csc_image_setup(&src, V4L2_PIX_FMT_XBGR32, buffer->width,
+			buffer->height, buffer->data);
+	src.strides[0] = buffer->stride;
 
-	ret = v4l2_poll(encoder->video_fd, &timeout);
-	if (ret <= 0)
-		return ret;
+	return v4l2_encoder_csc_convert(encoder, &src, &dst, region);
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &time_after);
+static bool v4l2_encoder_source_static(unsigned int source)
+{
+	switch (source) {
+	case V4L2_ENCODER_SOURCE_PATTERN_PNG:
+	case V4L2_ENCODER_SOURCE_GRADIENT:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	v4l2_buffer_setup_base(&buffer, encoder->output_type, encoder->memory);
+/* Sources rendered in RGB into the draw buffer, then converted. */
+static bool v4l2_encoder_source_rgb(unsigned int source)
+{
+	switch (source) {
+	case V4L2_ENCODER_SOURCE_PATTERN_PNG:
+	case V4L2_ENCODER_SOURCE_GRADIENT:
+	case V4L2_ENCODER_SOURCE_RECTANGLE:
+	case V4L2_ENCODER_SOURCE_MANDELBROT:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	do {
-		ret = v4l2_buffer_dequeue(encoder->video_fd, &buffer);
-		if (ret && ret != -EAGAIN)
-			return ret;
-	} while (ret == -EAGAIN);
+static void v4l2_encoder_frame_cache_cleanup(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_frame_cache *cache = &encoder->frame_cache;
+	unsigned int i;
 
-	printf("Dequeue picture buffer %u\n", buffer.index);
+	for (i = 0; i < cache->planes_count; i++) {
+		if (cache->data[i])
+			free(cache->data[i]);
 
-	if (buffer.index != output_buffer->buffer.index) {
-		printf("Picture index mismatch!\n");
-		return -1;
+		cache->data[i] = NULL;
+		cache->sizes[i] = 0;
 	}
 
-	v4l2_buffer_setup_base(&buffer, encoder->capture_type, encoder->memory);
+	cache->planes_count = 0;
+	cache->valid = false;
+}
 
-	do {
-		ret = v4l2_buffer_dequeue(encoder->video_fd, &buffer);
-		if (ret && ret != -EAGAIN)
-			return ret;
-	} while (ret == -EAGAIN);
+static int v4l2_encoder_frame_cache_fill(struct v4l2_encoder *encoder,
+					 struct v4l2_encoder_buffer *buffer)
+{
+	struct v4l2_encoder_frame_cache *cache = &encoder->frame_cache;
+	unsigned int source = encoder->setup.source;
+	unsigned int width, height;
+	unsigned int pixelformat;
+	unsigned int bytesperline = 0;
+	unsigned int i;
+	int ret;
 
-	v4l2_buffer_timestamp(&buffer, &timestamp);
-	frame_number = timestamp / 1000UL;
+	v4l2_format_pixel(&encoder->output_format, &width, &height,
+			  &pixelformat);
+	v4l2_format_bytesperline(&encoder->output_format, 0, &bytesperline);
 
-	printf("Dequeue coded frame %u in buffer %u\n", frame_number,
-	       capture_index);
+	if (cache->valid && cache->source == source && cache->width == width &&
+	    cache->height == height && cache->pixelformat == pixelformat &&
+	    cache->bytesperline == bytesperline)
+		return 0;
 
-	if (buffer.index != capture_buffer->buffer.index) {
-		printf("Picture index mismatch!\n");
-		return -1;
+	v4l2_encoder_frame_cache_cleanup(encoder);
+
+	for (i = 0; i < buffer->planes_count; i++) {
+		unsigned int length;
+
+		ret = v4l2_buffer_plane_length(&buffer->buffer, i, &length);
+		if (ret)
+			goto error;
+
+		cache->data[i] = malloc(length);
+		if (!cache->data[i]) {
+			ret = -ENOMEM;
+			goto error;
+		}
+
+		cache->sizes[i] = length;
+		cache->planes_count++;
+	}
+
+	switch (source) {
+	case V4L2_ENCODER_SOURCE_PATTERN_PNG:
+		draw_png(encoder->draw_buffer, "test-pattern.png");
+		break;
+	case V4L2_ENCODER_SOURCE_GRADIENT:
+		draw_gradient(encoder->draw_buffer);
+		break;
+	default:
+		ret = -EINVAL;
+		goto error;
 	}
 
-	encoder->capture_returned_index = buffer.index;
-	encoder->capture_buffers[buffer.index].buffer = buffer;
+	ret = v4l2_encoder_convert(encoder, NULL, cache->data);
+	if (ret)
+		goto error;
 
-	time_diff = timespec_diff(time_before, time_after);
+	cache->source = source;
+	cache->width = width;
+	cache->height = height;
+	cache->pixelformat = pixelformat;
+	cache->bytesperline = bytesperline;
+	cache->generation++;
+	cache->valid = true;
 
-	printf("Encode run took %llu us\n", time_diff / 1000ULL);
+	printf("Cached converted frame (generation %u)\n", cache->generation);
 
 	return 0;
+
+error:
+	v4l2_encoder_frame_cache_cleanup(encoder);
+
+	return ret;
 }
 
-int v4l2_encoder_start(struct v4l2_encoder *encoder)
+/*
+ * Sources with a moving region over a static background only need the union
+ * of the previous and current regions regenerated in a buffer that was
+ * already drawn to. A NULL region stands for the whole frame.
+ */
+static struct draw_region *v4l2_encoder_dirty_region(struct v4l2_encoder_buffer *buffer,
+						     struct draw_region *region,
+						     struct draw_region *dirty_region)
+{
+	if (!buffer->drawn)
+		return NULL;
+
+	*dirty_region = buffer->drawn_region;
+	draw_region_union(dirty_region, region);
+
+	return dirty_region;
+}
+
+static int v4l2_encoder_draw(struct v4l2_encoder *encoder,
+			     struct v4l2_encoder_buffer *output_buffer)
 {
+	unsigned int width, height;
+	struct draw_region region;
+	struct draw_region dirty_region;
+	struct draw_region *moving_region = NULL;
+	struct draw_region *convert_region = NULL;
+	struct csc_image image;
+	struct csc_image staging;
 	int ret;
 
-	if (!encoder || encoder->started)
-		return -EINVAL;
+	v4l2_format_pixel(&encoder->output_format, &width, &height, NULL);
 
-	ret = v4l2_stream_on(encoder->video_fd, encoder->output_type);
-	if (ret)
-		return ret;
+	/* Another encoder may have drawn into a shared buffer since. */
+	if (encoder->draw_buffer && encoder->draw_buffer->owner != encoder) {
+		unsigned int i;
 
-	ret = v4l2_stream_on(encoder->video_fd, encoder->capture_type);
-	if (ret)
-		return ret;
+		for (i = 0; i < encoder->output_buffers_count; i++)
+			encoder->output_buffers[i].drawn = false;
 
-	encoder->started = true;
+		encoder->background_drawn = false;
+		encoder->draw_buffer->owner = encoder;
+	}
 
-	return 0;
-}
+	switch (encoder->setup.source) {
+	case V4L2_ENCODER_SOURCE_MANDELBROT:
+		draw_mandelbrot_zoom(&encoder->draw_mandelbrot);
+		draw_mandelbrot(&encoder->draw_mandelbrot, encoder->draw_buffer);
+		break;
+	case V4L2_ENCODER_SOURCE_RECTANGLE:
+		region.x = encoder->x;
+		region.y = height / 3;
+		region.width = width / 3;
+		region.height = height / 3;
+
+		/* Only restore the background where the rectangle used to be. */
+		if (!encoder->background_drawn) {
+			draw_background(encoder->draw_buffer, 0xff00ffff);
+			encoder->background_drawn = true;
+		} else {
+			draw_rectangle(encoder->draw_buffer,
+				       encoder->rectangle_region.x,
+				       encoder->rectangle_region.y,
+				       encoder->rectangle_region.width,
+				       encoder->rectangle_region.height,
+				       0xff00ffff);
+		}
 
-int v4l2_encoder_stop(struct v4l2_encoder *encoder)
-{
-	int ret;
+		draw_rectangle(encoder->draw_buffer, region.x, region.y,
+			       region.width, region.height, 0x00ff0000);
+
+		encoder->rectangle_region = region;
+		moving_region = &region;
+		convert_region = v4l2_encoder_dirty_region(output_buffer,
+							   &region,
+							   &dirty_region);
+
+		if (!encoder->direction) {
+			if (encoder->x >= 20) {
+				encoder->x -= 20;
+			} else {
+				encoder->x = 0;
+				encoder->direction = 1;
+			}
+		} else {
+			if (encoder->x < (2 * width / 3 - 20)) {
+				encoder->x += 20;
+			} else {
+				encoder->x = 2 * width / 3;
+				encoder->direction = 0;
+			}
+		}
+		break;
+	case V4L2_ENCODER_SOURCE_PATTERN:
+		test_pattern_box(width, height, encoder->pattern_step, &region);
+		moving_region = &region;
+		convert_region = v4l2_encoder_dirty_region(output_buffer,
+							   &region,
+							   &dirty_region);
+
+		ret = v4l2_encoder_output_image(encoder,
+						output_buffer->mmap_data,
+						&image);
+		if (ret)
+			return ret;
 
-	if (!encoder || !encoder->started)
+		/* The pattern is NV12, other formats convert from staging. */
+		if (image.format == V4L2_PIX_FMT_NV12 &&
+		    encoder->setup.staging) {
+			test_pattern_step_staged(width, height,
+						 image.strides[0],
+						 encoder->pattern_step,
+						 image.planes[0],
+						 image.planes[1],
+						 convert_region,
+						 encoder->staging_data);
+		} else if (image.format == V4L2_PIX_FMT_NV12) {
+			test_pattern_step(width, height, image.strides[0],
+					  encoder->pattern_step,
+					  image.planes[0], image.planes[1],
+					  convert_region);
+		} else {
+			csc_image_setup(&staging, V4L2_PIX_FMT_NV12, width,
+					height, encoder->source_data);
+
+			test_pattern_step(width, height, staging.strides[0],
+					  encoder->pattern_step,
+					  staging.planes[0], staging.planes[1],
+					  NULL);
+
+			ret = v4l2_encoder_csc_convert(encoder, &staging,
+						       &image, convert_region);
+			if (ret)
+				return ret;
+		}
+
+		encoder->pattern_step++;
+		break;
+	default:
 		return -EINVAL;
+	}
 
-	ret = v4l2_stream_off(encoder->video_fd, encoder->output_type);
-	if (ret)
-		return ret;
+	printf("Drawing done\n");
 
-	ret = v4l2_stream_off(encoder->video_fd, encoder->capture_type);
+	if (moving_region)
+		output_buffer->drawn_region = *moving_region;
+
+	output_buffer->drawn = true;
+	output_buffer->cache_generation = 0;
+
+	if (encoder->setup.source == V4L2_ENCODER_SOURCE_PATTERN)
+		return 0;
+
+	ret = v4l2_encoder_convert(encoder, convert_region,
+				   output_buffer->mmap_data);
 	if (ret)
 		return ret;
 
-	encoder->started = false;
-
 	return 0;
 }
 
-int v4l2_encoder_buffer_setup(struct v4l2_encoder_buffer *buffer,
-			     unsigned int type, unsigned int index)
+static int v4l2_encoder_file_read(struct v4l2_encoder *encoder,
+				  struct v4l2_encoder_buffer *buffer)
 {
-	struct v4l2_encoder *encoder;
+	struct csc_image src;
+	struct csc_image dst;
+	unsigned int width, height;
+	bool direct = true;
+	ssize_t count;
+	off_t offset;
+	int frame_size;
+	unsigned int i;
 	int ret;
 
-	if (!buffer || !buffer->encoder)
-		return -EINVAL;
+	v4l2_format_pixel(&encoder->output_format, &width, &height, NULL);
 
-	encoder = buffer->encoder;
+	ret = v4l2_encoder_output_image(encoder, buffer->mmap_data, &dst);
+	if (ret)
+		return ret;
 
-	v4l2_buffer_setup_base(&buffer->buffer, type, encoder->memory);
-	v4l2_buffer_setup_index(&buffer->buffer, index);
-	v4l2_buffer_setup_planes(&buffer->buffer, type, buffer->planes,
-				 buffer->planes_count);
+	/* Raw frames are stored with packed planes in the source format. */
+	frame_size = csc_image_setup(&src, v4l2_encoder_source_format(encoder),
+				     width, height, encoder->source_data);
+	if (frame_size < 0)
+		return frame_size;
 
-	ret = v4l2_buffer_query(encoder->video_fd, &buffer->buffer);
-	if (ret) {
-		fprintf(stderr, "Failed to query buffer\n");
-		goto complete;
+	/* Loop back to the first frame at the end of the file. */
+	offset = lseek(encoder->source_fd, 0, SEEK_CUR);
+	if (offset < 0)
+		return -errno;
+
+	if (offset + frame_size > encoder->source_size) {
+		offset = lseek(encoder->source_fd, 0, SEEK_SET);
+		if (offset < 0)
+			return -errno;
 	}
 
-	if(encoder->memory == V4L2_MEMORY_MMAP) {
-		unsigned int i;
+	/* Read straight into the buffer when layouts match. */
+	if (src.format != dst.format)
+		direct = false;
+
+	for (i = 0; i < src.planes_count; i++)
+		if (src.strides[i] != dst.strides[i])
+			direct = false;
+
+	if (direct) {
+		for (i = 0; i < src.planes_count; i++) {
+			count = read(encoder->source_fd, dst.planes[i],
+				     src.sizes[i]);
+			if (count < 0)
+				return -errno;
+			else if (count < src.sizes[i])
+				return -EIO;
+		}
 
-		for (i = 0; i < buffer->planes_count; i++) {
-			unsigned int offset;
-			unsigned int length;
+		return 0;
+	}
 
-			ret = v4l2_buffer_plane_offset(&buffer->buffer, i,
-						       &offset);
-			if (ret)
-				goto complete;
+	count = read(encoder->source_fd, encoder->source_data, frame_size);
+	if (count < 0)
+		return -errno;
+	else if (count < frame_size)
+		return -EIO;
 
-			ret = v4l2_buffer_plane_length(&buffer->buffer, i,
-						       &length);
-			if (ret)
-				goto complete;
+	return v4l2_encoder_csc_convert(encoder, &src, &dst, NULL);
+}
 
-			buffer->mmap_data[i] =
-				mmap(NULL, length, PROT_READ | PROT_WRITE,
-				     MAP_SHARED, encoder->video_fd, offset);
-			if (buffer->mmap_data[i] == MAP_FAILED) {
-				ret = -errno;
-				goto complete;
-			}
+static int v4l2_encoder_source_fill(struct v4l2_encoder *encoder,
+				    struct v4l2_encoder_buffer *buffer)
+{
+	struct v4l2_encoder_frame_cache *cache = &encoder->frame_cache;
+	unsigned int i;
+	int ret;
 
-			printf("mapped plane %d length %d\n", i, length);
-		}
+	if (encoder->setup.source == V4L2_ENCODER_SOURCE_FILE) {
+		buffer->cpu_written = true;
+		return v4l2_encoder_file_read(encoder, buffer);
 	}
 
-	if (type == encoder->output_type) {
-		buffer->request_fd = media_request_alloc(encoder->media_fd);
-		if (buffer->request_fd < 0) {
-			ret = -EINVAL;
-			goto complete;
-		}
-	} else {
-		buffer->request_fd = -1;
+	if (!v4l2_encoder_source_static(encoder->setup.source)) {
+		buffer->cpu_written = true;
+		return v4l2_encoder_draw(encoder, buffer);
 	}
 
-	ret = 0;
+	ret = v4l2_encoder_frame_cache_fill(encoder, buffer);
+	if (ret)
+		return ret;
+
+	/* The buffer may still hold the cached frame from its last use. */
+	if (buffer->cache_generation != cache->generation) {
+		for (i = 0; i < cache->planes_count; i++)
+			memcpy(buffer->mmap_data[i], cache->data[i],
+			       cache->sizes[i]);
+
+		buffer->cache_generation = cache->generation;
+		buffer->cpu_written = true;
+	}
+
+	return 0;
+}
+
+static void v4l2_encoder_prerender_cleanup(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_prerender *prerender = &encoder->prerender;
+
+	if (prerender->data)
+		free(prerender->data);
+
+	memset(prerender, 0, sizeof(*prerender));
+}
+
+static int v4l2_encoder_prerender_setup(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_prerender *prerender = &encoder->prerender;
+	struct v4l2_encoder_buffer *output_buffer = &encoder->output_buffers[0];
+	struct v4l2_encoder_buffer staging;
+	unsigned int count = encoder->setup.prerender_count;
+	unsigned int frame_size = 0;
+	unsigned int i, j;
+	int ret;
+
+	for (i = 0; i < output_buffer->planes_count; i++) {
+		unsigned int length;
+
+		ret = v4l2_buffer_plane_length(&output_buffer->buffer, i,
+					       &length);
+		if (ret)
+			return ret;
+
+		prerender->offsets[i] = frame_size;
+		prerender->sizes[i] = length;
+		frame_size += length;
+	}
+
+	prerender->planes_count = output_buffer->planes_count;
+	prerender->frame_size = frame_size;
+
+	prerender->data = malloc((size_t)frame_size * count);
+	if (!prerender->data) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	/* Render through the regular source path into ring slots. */
+	staging = *output_buffer;
+
+	for (i = 0; i < count; i++) {
+		void *frame = prerender->data + (size_t)frame_size * i;
+
+		for (j = 0; j < prerender->planes_count; j++)
+			staging.mmap_data[j] = frame + prerender->offsets[j];
+
+		staging.drawn = false;
+		staging.cache_generation = 0;
+
+		ret = v4l2_encoder_source_fill(encoder, &staging);
+		if (ret)
+			goto error;
+	}
+
+	prerender->count = count;
+	prerender->index = 0;
+
+	printf("Pre-rendered %u frames of %u bytes\n", count, frame_size);
+
+	return 0;
+
+error:
+	v4l2_encoder_prerender_cleanup(encoder);
 
-complete:
 	return ret;
 }
 
-int v4l2_encoder_buffer_cleanup(struct v4l2_encoder_buffer *buffer)
+static unsigned int v4l2_encoder_qp_clamp(int qp)
 {
-	struct v4l2_encoder *encoder;
+	if (qp < 1)
+		return 1;
+	else if (qp > 51)
+		return 51;
 
-	if (!buffer || !buffer->encoder)
-		return -EINVAL;
+	return qp;
+}
 
-	encoder = buffer->encoder;
+static void v4l2_encoder_adaptive_qp(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_frame_params *params = &encoder->frame_params;
+	int offset;
+	int qp_i, qp_p;
 
-	if(encoder->memory == V4L2_MEMORY_MMAP) {
-		unsigned int i;
+	offset = analysis_qp_offset(&encoder->analysis);
 
-		for (i = 0; i < buffer->planes_count; i++) {
-			unsigned int length;
+	/* Controls keep their value, only changes need to be sent. */
+	if (offset == encoder->qp_offset && !params->qp_p)
+		return;
 
-			if (!buffer->mmap_data[i] ||
-			    buffer->mmap_data[i] == MAP_FAILED)
-					continue;
+	encoder->qp_offset = offset;
+
+	/*
+	 * The offset applies on top of the fixed or rate-controlled QP, never
+	 * on pending parameters that may already carry an offset.
+	 */
+	if (encoder->setup.rc_mode && !encoder->rate_control_hardware) {
+		qp_p = rate_control_qp(&encoder->rate_control);
+		qp_i = qp_p - ((int)encoder->setup.qp_p -
+			       (int)encoder->setup.qp_i);
+	} else {
+		qp_i = encoder->setup.qp_i;
+		qp_p = encoder->setup.qp_p;
+	}
+
+	v4l2_encoder_frame_qp(encoder,
+			      v4l2_encoder_qp_clamp(qp_i + encoder->qp_offset),
+			      v4l2_encoder_qp_clamp(qp_p + encoder->qp_offset));
+}
+
+static void v4l2_encoder_analyze(struct v4l2_encoder *encoder,
+				 struct v4l2_encoder_buffer *buffer)
+{
+	unsigned int bytesperline;
+
+	v4l2_format_bytesperline(&encoder->output_format, 0, &bytesperline);
+
+	analysis_frame(&encoder->analysis, buffer->mmap_data[0], bytesperline);
+
+	if (encoder->setup.adaptive_qp)
+		v4l2_encoder_adaptive_qp(encoder);
+
+	if (encoder->setup.scene_cut && encoder->analysis.scene_cut) {
+		printf("Scene cut detected (SAD %u, histogram delta %u)\n",
+		       encoder->analysis.sad,
+		       encoder->analysis.histogram_delta);
+
+		v4l2_encoder_frame_key(encoder);
+
+		encoder->stats.scene_cuts++;
+	}
+}
+
+static void v4l2_encoder_keyframe_request_check(struct v4l2_encoder *encoder)
+{
+	uint64_t interval = encoder->setup.keyframe_interval * 1000000ULL;
+	struct timespec now;
+	uint64_t time;
+
+	if (!atomic_load(&encoder->keyframe_request))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	/*
+	 * Requests arriving within the interval stay pending and are served
+	 * together by a single keyframe, which bounds the bitrate cost.
+	 */
+	if (encoder->keyframe_request_time &&
+	    time - encoder->keyframe_request_time < interval &&
+	    !encoder->frame_params.key_frame)
+		return;
+
+	atomic_store(&encoder->keyframe_request, false);
+
+	encoder->keyframe_request_time = time;
+	encoder->stats.keyframes_requested++;
 
+	v4l2_encoder_frame_key(encoder);
+}
+
+static bool v4l2_encoder_duplicate_check(struct v4l2_encoder *encoder,
+					 struct v4l2_encoder_buffer *buffer)
+{
+	struct v4l2_encoder_frame_params *params = &encoder->frame_params;
+	uint64_t hash = 0;
+	unsigned int length;
+	unsigned int i;
+
+	/* Requested keyframes and parameter updates must go out. */
+	if (params->key_frame || params->qp_i || params->qp_p ||
+	    params->bitrate)
+		return false;
+
+	/* Static sources only change with the frame cache generation. */
+	if (v4l2_encoder_source_static(encoder->setup.source) &&
+	    !encoder->prerender.count) {
+		hash = encoder->frame_cache.generation;
+	} else {
+		for (i = 0; i < buffer->planes_count; i++) {
 			v4l2_buffer_plane_length(&buffer->buffer, i, &length);
-			munmap(buffer->mmap_data[i], length);
+			hash = hash64(buffer->mmap_data[i], length, hash);
 		}
 	}
 
-	if (buffer->request_fd >= 0)
-		close(buffer->request_fd);
+	if (encoder->frame_hash_valid && hash == encoder->frame_hash)
+		return true;
 
-	memset(buffer, 0, sizeof(*buffer));
-	buffer->request_fd = -1;
+	encoder->frame_hash = hash;
 
-	return 0;
+	return false;
 }
 
-int v4l2_encoder_control_set(struct v4l2_encoder *encoder, unsigned int id,
-			     int value)
+#ifdef OUTPUT_DUMP
+/* Planes are dumped packed, following the negotiated output format. */
+static int v4l2_encoder_output_dump(struct v4l2_encoder *encoder,
+				    struct v4l2_encoder_buffer *buffer)
 {
-	struct v4l2_control control;
+	struct csc_image image;
+	struct csc_image packed;
+	unsigned int i, row;
+	int fd;
 	int ret;
 
-	v4l2_control_setup_base(&control, id);
-	v4l2_control_setup_value(&control, value);
-
-	ret = v4l2_control_set(encoder->video_fd, &control);
+	ret = v4l2_encoder_output_image(encoder, buffer->mmap_data, &image);
 	if (ret)
-		fprintf(stderr, "Failed to set control\n");
+		return ret;
 
-	return ret;
+	csc_image_setup(&packed, image.format, image.width, image.height,
+			NULL);
+
+	fd = open("output.yuv",  O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("output open error!\n");
+		return -1;
+	}
+
+	for (i = 0; i < image.planes_count; i++)
+		for (row = 0; row < packed.sizes[i] / packed.strides[i]; row++)
+			write(fd, image.planes[i] + row * image.strides[i],
+			      packed.strides[i]);
+
+	close(fd);
+
+	return 0;
 }
+#endif
 
-int v4l2_encoder_setup_defaults(struct v4l2_encoder *encoder)
+int v4l2_encoder_prepare(struct v4l2_encoder *encoder)
 {
+	struct v4l2_encoder_prerender *prerender;
+	struct v4l2_encoder_buffer *output_buffer;
+	unsigned int output_index;
+	unsigned int i;
 	int ret;
 
 	if (!encoder)
 		return -EINVAL;
 
-	if (encoder->up)
-		return -EBUSY;
+	prerender = &encoder->prerender;
 
-	ret = v4l2_encoder_setup_dimensions(encoder, 1280, 720);
-	if (ret)
-		return ret;
+	/* Generated pictures are captured when they start being prepared. */
+	if (!encoder->frame_timestamp)
+		encoder->frame_timestamp = v4l2_encoder_time();
 
-	ret = v4l2_encoder_setup_format(encoder, V4L2_PIX_FMT_NV12);
-	if (ret)
-		return ret;
+	output_index = encoder->output_buffers_index;
+	output_buffer = &encoder->output_buffers[output_index];
 
-	ret = v4l2_encoder_setup_fps(encoder, 25);
-	if (ret)
-		return ret;
+	if (prerender->count) {
+		unsigned int slot = prerender->index;
 
-	ret = v4l2_encoder_setup_qp(encoder, 24, 26);
+		prerender->index = (slot + 1) % prerender->count;
+
+		/* Buffers already holding the slot are submitted as-is. */
+		if (output_buffer->prerender_slot != slot + 1) {
+			void *frame = prerender->data +
+				      (size_t)prerender->frame_size * slot;
+
+			for (i = 0; i < prerender->planes_count; i++)
+				memcpy(output_buffer->mmap_data[i],
+				       frame + prerender->offsets[i],
+				       prerender->sizes[i]);
+
+			output_buffer->prerender_slot = slot + 1;
+			output_buffer->cpu_written = true;
+		}
+	} else {
+		ret = v4l2_encoder_source_fill(encoder, output_buffer);
+		if (ret)
+			return ret;
+	}
+
+	if (encoder->setup.adaptive_qp || encoder->setup.scene_cut)
+		v4l2_encoder_analyze(encoder, output_buffer);
+
+	v4l2_encoder_keyframe_request_check(encoder);
+
+	if (encoder->setup.skip_duplicates) {
+		encoder->frame_skip =
+			v4l2_encoder_duplicate_check(encoder, output_buffer);
+		encoder->frame_hash_valid = true;
+	}
+
+#ifdef OUTPUT_DUMP
+	ret = v4l2_encoder_output_dump(encoder, output_buffer);
 	if (ret)
 		return ret;
+#endif
 
-	ret = v4l2_encoder_setup_gop(encoder, 0, 3);
+	return 0;
+}
+
+static unsigned int v4l2_encoder_gop_control(struct v4l2_encoder *encoder)
+{
+	if (encoder->setup.gop_closure)
+		return V4L2_CID_MPEG_VIDEO_GOP_SIZE;
+	else
+		return V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+}
+
+static int v4l2_encoder_frame_controls(struct v4l2_encoder *encoder,
+				       struct v4l2_encoder_buffer *buffer)
+{
+	struct v4l2_encoder_frame_params *params = &encoder->frame_params;
+	struct v4l2_encoder_controls controls;
+	int ret;
+
+	v4l2_encoder_controls_init(&controls);
+
+	if (params->qp_i)
+		v4l2_encoder_controls_add(&controls,
+					  V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP,
+					  params->qp_i);
+
+	if (params->qp_p)
+		v4l2_encoder_controls_add(&controls,
+					  V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP,
+					  params->qp_p);
+
+	if (params->bitrate)
+		v4l2_encoder_controls_add(&controls,
+					  V4L2_CID_MPEG_VIDEO_BITRATE,
+					  params->bitrate);
+
+	if (params->key_frame)
+		v4l2_encoder_controls_add(&controls,
+					  V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME,
+					  0);
+
+	ret = v4l2_encoder_controls_commit(encoder, &controls,
+					   buffer->request_fd);
 	if (ret)
 		return ret;
 
+	memset(params, 0, sizeof(*params));
+
 	return 0;
 }
 
-int v4l2_encoder_setup_dimensions(struct v4l2_encoder *encoder,
-				  unsigned int width, unsigned int height)
+int v4l2_encoder_frame_qp(struct v4l2_encoder *encoder, unsigned int qp_i,
+			  unsigned int qp_p)
 {
-	if (!encoder || !width || !height)
+	if (!encoder)
 		return -EINVAL;
 
-	if (encoder->up)
-		return -EBUSY;
-
-	encoder->setup.width = width;
-	encoder->setup.height = height;
+	encoder->frame_params.qp_i = qp_i;
+	encoder->frame_params.qp_p = qp_p;
 
 	return 0;
 }
 
-int v4l2_encoder_setup_format(struct v4l2_encoder *encoder, uint32_t format)
+int v4l2_encoder_frame_bitrate(struct v4l2_encoder *encoder,
+			       unsigned int bitrate)
 {
 	if (!encoder)
 		return -EINVAL;
 
-	if (encoder->up)
-		return -EBUSY;
-
-	encoder->setup.format = format;
+	encoder->frame_params.bitrate = bitrate;
 
 	return 0;
 }
 
-int v4l2_encoder_setup_fps(struct v4l2_encoder *encoder, float fps)
+int v4l2_encoder_frame_key(struct v4l2_encoder *encoder)
 {
-	if (!encoder || !fps)
+	if (!encoder)
 		return -EINVAL;
 
-	encoder->setup.fps_den = 1000;
-	encoder->setup.fps_num = fps * encoder->setup.fps_den;
+	encoder->frame_params.key_frame = true;
 
 	return 0;
 }
 
-int v4l2_encoder_setup_qp(struct v4l2_encoder *encoder, unsigned int qp_i,
-			  unsigned int qp_p)
+int v4l2_encoder_frame_timestamp(struct v4l2_encoder *encoder,
+				 uint64_t timestamp)
 {
-	if (!encoder || !qp_i || !qp_p)
+	if (!encoder || !timestamp)
 		return -EINVAL;
 
-	encoder->setup.qp_i = qp_i;
-	encoder->setup.qp_p = qp_p;
+	encoder->frame_timestamp = timestamp;
 
 	return 0;
 }
 
-int v4l2_encoder_setup_gop(struct v4l2_encoder *encoder, unsigned int closure,
-			   unsigned int size)
+int v4l2_encoder_frame_data(struct v4l2_encoder *encoder, void *data)
 {
 	if (!encoder)
 		return -EINVAL;
 
-	encoder->setup.gop_closure = closure;
-	encoder->setup.gop_size = size;
+	encoder->frame_data = data;
 
 	return 0;
 }
 
-int v4l2_encoder_setup(struct v4l2_encoder *encoder)
+/* Last completed frame, valid until the next one is submitted. */
+struct v4l2_encoder_frame *
+v4l2_encoder_frame_returned(struct v4l2_encoder *encoder)
 {
-	unsigned int width, height;
-	unsigned int width_coded, height_coded;
-	unsigned int buffers_count;
-	unsigned int capture_size;
-	struct v4l2_streamparm streamparm;
-	uint32_t format;
-	unsigned int i;
-	int ret;
+	if (!encoder)
+		return NULL;
 
-	if (!encoder || encoder->up)
-		return -EINVAL;
+	return encoder->frame_returned;
+}
 
-	capture_size = 2 * 1024 * 1024;
-	width = encoder->setup.width;
-	height = encoder->setup.height;
-	format = encoder->setup.format;
+/*
+ * V4L2 timestamps only keep microseconds, so keys are bumped to stay
+ * unique when frames are captured closer than that.
+ */
+static struct v4l2_encoder_frame *
+v4l2_encoder_frame_submit(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_frame *frame = NULL;
+	uint64_t v4l2_timestamp;
+	unsigned int i;
 
-	/* Setup capture format. */
+	for (i = 0; i < ARRAY_SIZE(encoder->frames); i++) {
+		if (!encoder->frames[i].used) {
+			frame = &encoder->frames[i];
+			break;
+		}
+	}
+
+	if (!frame)
+		return NULL;
+
+	if (!encoder->frame_timestamp)
+		encoder->frame_timestamp = v4l2_encoder_time();
+
+	v4l2_timestamp = encoder->frame_timestamp / 1000ULL * 1000ULL;
+	if (v4l2_timestamp <= encoder->v4l2_timestamp_last)
+		v4l2_timestamp = encoder->v4l2_timestamp_last + 1000ULL;
+
+	encoder->v4l2_timestamp_last = v4l2_timestamp;
+
+	frame->v4l2_timestamp = v4l2_timestamp;
+	frame->timestamp = encoder->frame_timestamp;
+	frame->frame_number = encoder->frame_number;
+	frame->data = encoder->frame_data;
+	frame->used = true;
+	frame->completed = false;
+
+	encoder->frame_timestamp = 0;
+	encoder->frame_data = NULL;
+
+	return frame;
+}
+
+static struct v4l2_encoder_frame *
+v4l2_encoder_frame_find(struct v4l2_encoder *encoder, uint64_t v4l2_timestamp)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(encoder->frames); i++)
+		if (encoder->frames[i].used &&
+		    encoder->frames[i].v4l2_timestamp == v4l2_timestamp)
+			return &encoder->frames[i];
+
+	return NULL;
+}
+
+static void v4l2_encoder_frames_release(struct v4l2_encoder *encoder)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(encoder->frames); i++)
+		encoder->frames[i].used = false;
+
+	encoder->frame_returned = NULL;
+}
+
+/*
+ * Waits for the schedule slot of the next frame, wakeups slightly past it
+ * not counting as late. Frames only ever run one at a time, so falling
+ * behind by whole periods means the source frames captured meanwhile have
+ * nowhere to go: the oldest are dropped and the latest one is admitted,
+ * unless dropping is disabled and the loop catches up instead.
+ */
+int v4l2_encoder_pace(struct v4l2_encoder *encoder)
+{
+	struct timespec time;
+	uint64_t period;
+	uint64_t tolerance;
+	uint64_t deadline;
+	uint64_t now;
+
+	if (!encoder)
+		return -EINVAL;
+
+	if (!encoder->setup.pacing || !encoder->setup.fps_num)
+		return 0;
+
+	period = 1000000000ULL * encoder->setup.fps_den /
+		 encoder->setup.fps_num;
+	tolerance = period / V4L2_ENCODER_PACING_TOLERANCE;
+	now = v4l2_encoder_time();
+
+	if (!encoder->pacing_slot)
+		encoder->pacing_start = now;
+
+	deadline = encoder->pacing_start + encoder->pacing_slot * period;
+
+	if (now < deadline) {
+		time.tv_sec = deadline / 1000000000ULL;
+		time.tv_nsec = deadline % 1000000000ULL;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time,
+				       NULL) == EINTR);
+	} else if (now > deadline + tolerance) {
+		uint64_t missed = (now - deadline - tolerance) / period;
+
+		if (encoder->setup.pacing_drop && missed) {
+			printf("Drop %llu late frames\n",
+			       (unsigned long long)missed);
+
+			encoder->stats.dropped += missed;
+			encoder->pacing_slot += missed;
+			deadline += missed * period;
+		}
+
+		encoder->stats.late++;
+	}
+
+	encoder->pacing_slot++;
+
+	/* The frame is considered captured when it was due. */
+	if (!encoder->frame_timestamp)
+		encoder->frame_timestamp = deadline;
+
+	return 0;
+}
+
+int v4l2_encoder_request_keyframe(struct v4l2_encoder *encoder)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	atomic_fetch_add(&encoder->keyframe_requests, 1);
+	atomic_store(&encoder->keyframe_request, true);
+
+	return 0;
+}
+
+/*
+ * Unchanged pictures need no clean. Other maintenance is already skipped
+ * by vb2 based on the queue direction.
+ */
+static void v4l2_encoder_output_cache_hints(struct v4l2_encoder *encoder,
+					    struct v4l2_encoder_buffer *buffer)
+{
+	struct v4l2_buffer *v4l2_buffer = &buffer->buffer;
+
+	v4l2_buffer->flags &= ~V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+
+	if (encoder->output_non_coherent && !buffer->cpu_written) {
+		v4l2_buffer->flags |= V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+		encoder->stats.cache_cleans_skipped++;
+	}
+
+	buffer->cpu_written = false;
+}
+
+/* Buffers are all given back when streaming off. */
+static void v4l2_encoder_buffers_returned(struct v4l2_encoder *encoder)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(encoder->output_buffers); i++)
+		encoder->output_buffers[i].queued = false;
+
+	for (i = 0; i < ARRAY_SIZE(encoder->capture_buffers); i++)
+		encoder->capture_buffers[i].queued = false;
+}
+
+static int v4l2_encoder_buffer_queue(struct v4l2_encoder *encoder,
+				     struct v4l2_encoder_buffer *buffer)
+{
+	int ret;
+
+	if (buffer->queued) {
+		fprintf(stderr, "Buffer %u is still owned by the driver\n",
+			buffer->buffer.index);
+		return -EBUSY;
+	}
+
+	ret = v4l2_buffer_queue(encoder->video_fd, &buffer->buffer);
+	if (ret)
+		return ret;
+
+	buffer->queued = true;
+
+	return 0;
+}
+
+/*
+ * Dequeues the next buffer the driver is done with, whichever it is.
+ * Returned coded buffers are kept with their flags and payload, using the
+ * tracked buffer's own planes.
+ */
+static int v4l2_encoder_buffer_dequeue(struct v4l2_encoder *encoder,
+				       unsigned int type,
+				       struct v4l2_encoder_buffer **buffer)
+{
+	struct v4l2_encoder_buffer *encoder_buffer;
+	struct v4l2_plane planes[4];
+	struct v4l2_buffer v4l2_buffer;
+	unsigned int count;
+	int ret;
+
+	v4l2_buffer_setup_base(&v4l2_buffer, type, encoder->memory);
+	v4l2_buffer_setup_planes(&v4l2_buffer, type, planes,
+				 ARRAY_SIZE(planes));
+
+	ret = v4l2_buffer_dequeue(encoder->video_fd, &v4l2_buffer);
+	if (ret)
+		return ret;
+
+	if (type == encoder->output_type)
+		count = encoder->output_buffers_count;
+	else
+		count = ARRAY_SIZE(encoder->capture_buffers);
+
+	if (v4l2_buffer.index >= count)
+		return -EINVAL;
+
+	if (type == encoder->output_type)
+		encoder_buffer = &encoder->output_buffers[v4l2_buffer.index];
+	else
+		encoder_buffer = &encoder->capture_buffers[v4l2_buffer.index];
+
+	if (type == encoder->capture_type) {
+		memcpy(encoder_buffer->planes, planes,
+		       sizeof(encoder_buffer->planes));
+		v4l2_buffer_setup_planes(&v4l2_buffer, type,
+					 encoder_buffer->planes,
+					 encoder_buffer->planes_count);
+
+		encoder_buffer->buffer = v4l2_buffer;
+	}
+
+	encoder_buffer->queued = false;
+	*buffer = encoder_buffer;
+
+	return 0;
+}
+
+/*
+ * A request may complete after its picture buffer was dequeued, so it is
+ * only recycled when the buffer is used again, once signalled complete.
+ */
+static int v4l2_encoder_request_recycle(struct v4l2_encoder_buffer *buffer)
+{
+	struct timeval timeout;
+	int ret;
+
+	if (!buffer->request_queued)
+		return 0;
+
+	timeout.tv_sec = V4L2_ENCODER_WATCHDOG_MAX / 1000000;
+	timeout.tv_usec = V4L2_ENCODER_WATCHDOG_MAX % 1000000;
+
+	ret = media_request_poll(buffer->request_fd, &timeout);
+	if (ret < 0)
+		return ret;
+	else if (!ret)
+		return -ETIMEDOUT;
+
+	ret = media_request_reinit(buffer->request_fd);
+	if (ret)
+		return ret;
+
+	buffer->request_queued = false;
+
+	return 0;
+}
+
+/* Takes back every buffer ready on both queues, in any order. */
+static int v4l2_encoder_reap(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_buffer *buffer;
+	struct v4l2_encoder_frame *frame;
+	uint64_t timestamp;
+	int ret;
+
+	while (!(ret = v4l2_encoder_buffer_dequeue(encoder,
+						   encoder->output_type,
+						   &buffer))) {
+		printf("Dequeue picture buffer %u\n", buffer->buffer.index);
+	}
+
+	if (ret != -EAGAIN)
+		return ret;
+
+	while (!(ret = v4l2_encoder_buffer_dequeue(encoder,
+						   encoder->capture_type,
+						   &buffer))) {
+		/* The timestamp is copied over from the picture. */
+		v4l2_buffer_timestamp(&buffer->buffer, &timestamp);
+
+		frame = v4l2_encoder_frame_find(encoder, timestamp);
+		if (!frame) {
+			fprintf(stderr, "Unknown coded frame timestamp %llu\n",
+				(unsigned long long)timestamp);
+			continue;
+		}
+
+		frame->capture_index = buffer->buffer.index;
+		frame->completed = true;
+
+		printf("Dequeue coded frame %u in buffer %u\n",
+		       frame->frame_number, frame->capture_index);
+	}
+
+	if (ret != -EAGAIN)
+		return ret;
+
+	return 0;
+}
+
+/*
+ * The deadline follows the measured encode time distribution. Missing it
+ * makes a slow frame, given twice as long again before the engine is
+ * considered hung.
+ */
+static uint64_t v4l2_encoder_watchdog_deadline(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_jitter *jitter = &encoder->stats.encode_jitter;
+	double mean, deviation;
+	uint64_t deadline;
+
+	if (jitter->count < V4L2_ENCODER_WATCHDOG_FRAMES)
+		return V4L2_ENCODER_WATCHDOG_MAX;
+
+	v4l2_encoder_jitter_stats(jitter, &mean, &deviation);
+
+	deadline = fmax(mean + 6 * deviation, 2 * mean) / 1000.;
+
+	if (deadline < V4L2_ENCODER_WATCHDOG_MIN)
+		deadline = V4L2_ENCODER_WATCHDOG_MIN;
+	else if (deadline > V4L2_ENCODER_WATCHDOG_MAX)
+		deadline = V4L2_ENCODER_WATCHDOG_MAX;
+
+	return deadline;
+}
+
+/* Waits within the deadline of a frame submitted at start, in ns. */
+static int v4l2_encoder_watchdog_poll(struct v4l2_encoder *encoder,
+				      uint64_t start, uint64_t deadline)
+{
+	uint64_t elapsed = (v4l2_encoder_time() - start) / 1000ULL;
+	uint64_t remaining = elapsed < deadline ? deadline - elapsed : 0;
+	struct timeval timeout;
+	int ret;
+
+	if (!remaining)
+		return -ETIMEDOUT;
+
+	timeout.tv_sec = remaining / 1000000;
+	timeout.tv_usec = remaining % 1000000;
+
+	ret = v4l2_poll(encoder->video_fd, &timeout);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	return -ETIMEDOUT;
+}
+
+/*
+ * Waits of the same frame share its deadline, computed once when it is
+ * submitted, so that a frame is only ever counted slow once.
+ */
+static int v4l2_encoder_watchdog_wait(struct v4l2_encoder *encoder,
+				      uint64_t start, uint64_t deadline,
+				      bool *slow)
+{
+	int ret;
+
+	if (!*slow) {
+		ret = v4l2_encoder_watchdog_poll(encoder, start, deadline);
+		if (ret != -ETIMEDOUT)
+			return ret;
+
+		printf("Encode run exceeded %llu us deadline\n",
+		       (unsigned long long)deadline);
+
+		encoder->stats.slow++;
+		*slow = true;
+	}
+
+	ret = v4l2_encoder_watchdog_poll(encoder, start, 3 * deadline);
+	if (ret != -ETIMEDOUT)
+		return ret;
+
+	fprintf(stderr, "Encoder hung after %llu us\n",
+		(unsigned long long)deadline * 3);
+
+	encoder->stats.hangs++;
+
+	return -ETIMEDOUT;
+}
+
+/* Streaming off returns all buffers and cancels the stuck job. */
+static int v4l2_encoder_recover(struct v4l2_encoder *encoder)
+{
+	struct timespec time_before, time_after;
+	unsigned int i;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &time_before);
+
+	ret = v4l2_stream_off(encoder->video_fd, encoder->output_type);
+	if (ret)
+		return ret;
+
+	ret = v4l2_stream_off(encoder->video_fd, encoder->capture_type);
+	if (ret)
+		return ret;
+
+	v4l2_encoder_buffers_returned(encoder);
+
+	for (i = 0; i < encoder->output_buffers_count; i++) {
+		media_request_reinit(encoder->output_buffers[i].request_fd);
+		encoder->output_buffers[i].request_queued = false;
+	}
+
+	ret = v4l2_stream_on(encoder->video_fd, encoder->output_type);
+	if (ret)
+		return ret;
+
+	ret = v4l2_stream_on(encoder->video_fd, encoder->capture_type);
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &time_after);
+
+	printf("Recovered encoder in %llu us\n",
+	       timespec_diff(time_before, time_after) / 1000ULL);
+
+	return 0;
+}
+
+int v4l2_encoder_run(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_buffer *output_buffer;
+	unsigned int output_index;
+	struct v4l2_encoder_buffer *capture_buffer;
+	unsigned int capture_index;
+	struct v4l2_encoder_frame *frame;
+	struct v4l2_encoder_frame_params params;
+	unsigned int frame_number = encoder->frame_number;
+	struct timespec time_before, time_after;
+	uint64_t time_diff;
+	uint64_t submit_time;
+	uint64_t deadline;
+	unsigned int length = 0;
+	bool recovered = false;
+	bool slow;
+	unsigned int i;
+	int ret;
+
+	if (!encoder)
+		return -EINVAL;
+
+	/* The buffer is left as-is and prepared again for the next frame. */
+	if (encoder->frame_skip) {
+		printf("Skip duplicate picture frame %u\n", frame_number);
+		memset(&encoder->frame_params, 0,
+		       sizeof(encoder->frame_params));
+		encoder->frame_timestamp = 0;
+		encoder->frame_data = NULL;
+		encoder->frame_returned = NULL;
+		return 0;
+	}
+
+	encoder->frame_returned = NULL;
+
+	frame = v4l2_encoder_frame_submit(encoder);
+	if (!frame)
+		return -EBUSY;
+
+	output_index = encoder->output_buffers_index;
+	output_buffer = &encoder->output_buffers[output_index];
+
+	encoder->output_buffers_index++;
+	encoder->output_buffers_index %= encoder->output_buffers_count;
+
+	capture_index = encoder->capture_buffers_base +
+			encoder->capture_buffers_index;
+	capture_buffer = &encoder->capture_buffers[capture_index];
+
+	encoder->capture_buffers_index++;
+	encoder->capture_buffers_index %= encoder->capture_buffers_count;
+
+	/* Kept to submit the frame again after recovering from a hang. */
+	params = encoder->frame_params;
+
+submit:
+	v4l2_buffer_plane_length(&output_buffer->buffer, 0, &length);
+	v4l2_buffer_setup_plane_length_used(&output_buffer->buffer, 0, length);
+
+	v4l2_buffer_setup_timestamp(&output_buffer->buffer,
+				    frame->v4l2_timestamp);
+
+	printf("Queue picture frame %u in buffer %u\n", frame_number,
+	       output_index);
+
+	ret = v4l2_encoder_request_recycle(output_buffer);
+	if (ret)
+		goto error;
+
+	/* Bundle per-frame controls with the picture in its request. */
+	ret = v4l2_encoder_frame_controls(encoder, output_buffer);
+	if (ret)
+		goto error;
+
+	v4l2_buffer_request_attach(&output_buffer->buffer,
+				   output_buffer->request_fd);
+
+	v4l2_encoder_output_cache_hints(encoder, output_buffer);
+
+	ret = v4l2_encoder_buffer_queue(encoder, output_buffer);
+	if (ret)
+		goto error;
+
+	ret = media_request_queue(output_buffer->request_fd);
+	if (ret)
+		goto error;
+
+	output_buffer->request_queued = true;
+
+	printf("Queue coded buffer %u\n", capture_index);
+
+	clock_gettime(CLOCK_MONOTONIC, &time_before);
+
+	submit_time = time_before.tv_sec * 1000000000ULL + time_before.tv_nsec;
+	deadline = v4l2_encoder_watchdog_deadline(encoder);
+	slow = false;
+
+	ret = v4l2_encoder_buffer_queue(encoder, capture_buffer);
+	if (ret)
+		goto error;
+
+wait:
+	ret = v4l2_encoder_watchdog_wait(encoder, submit_time, deadline,
+					 &slow);
+	if (ret == -ETIMEDOUT) {
+		ret = v4l2_encoder_recover(encoder);
+		if (ret)
+			goto error;
+
+		/* The frame is given up when it hangs the engine twice. */
+		if (recovered) {
+			ret = -ETIMEDOUT;
+			goto error;
+		}
+
+		/* Encoder state was lost, restart from a keyframe. */
+		encoder->frame_params = params;
+		encoder->frame_params.key_frame = true;
+		recovered = true;
+
+		goto submit;
+	} else if (ret) {
+		goto error;
+	}
+
+	ret = v4l2_encoder_reap(encoder);
+	if (ret)
+		goto error;
+
+	/* Other completions may come first with deeper queues. */
+	if (!frame->completed)
+		goto wait;
+
+	clock_gettime(CLOCK_MONOTONIC, &time_after);
+
+	encoder->frame_returned = frame;
+	encoder->capture_returned_index = frame->capture_index;
+
+	time_diff = timespec_diff(time_before, time_after);
+
+	printf("Encode run took %llu us\n", time_diff / 1000ULL);
+
+	encoder->stats.encode_time += time_diff;
+	v4l2_encoder_jitter_update(&encoder->stats.encode_jitter, time_diff);
+
+	for (i = 0; i < output_buffer->planes_count; i++) {
+		v4l2_buffer_plane_length(&output_buffer->buffer, i, &length);
+		encoder->stats.output_bytes += length;
+	}
+
+	return 0;
+
+error:
+	frame->used = false;
+
+	return ret;
+}
+
+/*
+ * The first job pays for clock and engine power-up, so a throwaway picture
+ * is encoded before the real ones, which then restart with a keyframe.
+ */
+static int v4l2_encoder_warmup(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_frame_params params = encoder->frame_params;
+	struct v4l2_encoder_stats stats = encoder->stats;
+	struct timespec time_before, time_after;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &time_before);
+
+	ret = v4l2_encoder_run(encoder);
+
+	clock_gettime(CLOCK_MONOTONIC, &time_after);
+
+	v4l2_encoder_frames_release(encoder);
+
+	encoder->stats = stats;
+	encoder->stats.warmup_time = timespec_diff(time_before, time_after);
+
+	if (ret)
+		return ret;
+
+	encoder->frame_params = params;
+	encoder->frame_params.key_frame = true;
+
+	printf("Warm-up encode took %llu us\n",
+	       encoder->stats.warmup_time / 1000ULL);
+
+	return 0;
+}
+
+static int v4l2_encoder_stream_on(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	ret = v4l2_stream_on(encoder->video_fd, encoder->output_type);
+	if (ret)
+		return ret;
+
+	ret = v4l2_stream_on(encoder->video_fd, encoder->capture_type);
+	if (ret)
+		return ret;
+
+	encoder->started = true;
+
+	return 0;
+}
+
+int v4l2_encoder_start(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	if (!encoder || encoder->started)
+		return -EINVAL;
+
+	ret = v4l2_encoder_stream_on(encoder);
+	if (ret)
+		return ret;
+
+	if (encoder->setup.warmup) {
+		ret = v4l2_encoder_warmup(encoder);
+		if (ret)
+			return ret;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &encoder->start_time);
+
+	return 0;
+}
+
+int v4l2_encoder_stop(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	if (!encoder || !encoder->started)
+		return -EINVAL;
+
+	ret = v4l2_stream_off(encoder->video_fd, encoder->output_type);
+	if (ret)
+		return ret;
+
+	ret = v4l2_stream_off(encoder->video_fd, encoder->capture_type);
+	if (ret)
+		return ret;
+
+	/* Frames in flight were returned without being encoded. */
+	v4l2_encoder_buffers_returned(encoder);
+	v4l2_encoder_frames_release(encoder);
+
+	encoder->started = false;
+
+	return 0;
+}
+
+int v4l2_encoder_buffer_setup(struct v4l2_encoder_buffer *buffer,
+			     unsigned int type, unsigned int index)
+{
+	struct v4l2_encoder *encoder;
+	int ret;
+
+	if (!buffer || !buffer->encoder)
+		return -EINVAL;
+
+	encoder = buffer->encoder;
+
+	v4l2_buffer_setup_base(&buffer->buffer, type, encoder->memory);
+	v4l2_buffer_setup_index(&buffer->buffer, index);
+	v4l2_buffer_setup_planes(&buffer->buffer, type, buffer->planes,
+				 buffer->planes_count);
+
+	ret = v4l2_buffer_query(encoder->video_fd, &buffer->buffer);
+	if (ret) {
+		fprintf(stderr, "Failed to query buffer\n");
+		goto complete;
+	}
+
+	if(encoder->memory == V4L2_MEMORY_MMAP) {
+		unsigned int i;
+
+		for (i = 0; i < buffer->planes_count; i++) {
+			int flags = MAP_SHARED;
+			unsigned int offset;
+			unsigned int length;
+
+			ret = v4l2_buffer_plane_offset(&buffer->buffer, i,
+						       &offset);
+			if (ret)
+				goto complete;
+
+			ret = v4l2_buffer_plane_length(&buffer->buffer, i,
+						       &length);
+			if (ret)
+				goto complete;
+
+			/* Pre-fault the planes instead of on first touch. */
+			if (encoder->setup.warmup)
+				flags |= MAP_POPULATE;
+
+			buffer->mmap_data[i] =
+				mmap(NULL, length, PROT_READ | PROT_WRITE,
+				     flags, encoder->video_fd, offset);
+			if (buffer->mmap_data[i] == MAP_FAILED) {
+				ret = -errno;
+				goto complete;
+			}
+
+			printf("mapped plane %d length %d\n", i, length);
+		}
+	}
+
+	if (type == encoder->output_type) {
+		buffer->request_fd = media_request_alloc(encoder->media_fd);
+		if (buffer->request_fd < 0) {
+			ret = -EINVAL;
+			goto complete;
+		}
+
+		buffer->request_queued = false;
+	} else {
+		buffer->request_fd = -1;
+	}
+
+	ret = 0;
+
+complete:
+	return ret;
+}
+
+int v4l2_encoder_buffer_cleanup(struct v4l2_encoder_buffer *buffer)
+{
+	struct v4l2_encoder *encoder;
+
+	if (!buffer || !buffer->encoder)
+		return -EINVAL;
+
+	encoder = buffer->encoder;
+
+	if(encoder->memory == V4L2_MEMORY_MMAP) {
+		unsigned int i;
+
+		for (i = 0; i < buffer->planes_count; i++) {
+			unsigned int length;
+
+			if (!buffer->mmap_data[i] ||
+			    buffer->mmap_data[i] == MAP_FAILED)
+					continue;
+
+			v4l2_buffer_plane_length(&buffer->buffer, i, &length);
+			munmap(buffer->mmap_data[i], length);
+		}
+	}
+
+	if (buffer->request_fd >= 0)
+		close(buffer->request_fd);
+
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->request_fd = -1;
+
+	return 0;
+}
+
+static bool v4l2_encoder_control_check(struct v4l2_encoder *encoder,
+				       unsigned int id)
+{
+	struct v4l2_queryctrl queryctrl = { 0 };
+	int ret;
+
+	queryctrl.id = id;
+
+	ret = v4l2_control_query(encoder->video_fd, &queryctrl);
+	if (ret)
+		return false;
+
+	return !(queryctrl.flags & V4L2_CTRL_FLAG_DISABLED);
+}
+
+void v4l2_encoder_controls_init(struct v4l2_encoder_controls *controls)
+{
+	if (!controls)
+		return;
+
+	controls->count = 0;
+}
+
+int v4l2_encoder_controls_add(struct v4l2_encoder_controls *controls,
+			      unsigned int id, int value)
+{
+	struct v4l2_ext_control *control = NULL;
+	unsigned int i;
+
+	if (!controls)
+		return -EINVAL;
+
+	/* Later changes to the same control replace earlier ones. */
+	for (i = 0; i < controls->count; i++) {
+		if (controls->controls[i].id == id) {
+			control = &controls->controls[i];
+			break;
+		}
+	}
+
+	if (!control) {
+		if (controls->count == ARRAY_SIZE(controls->controls))
+			return -ENOSPC;
+
+		control = &controls->controls[controls->count];
+		controls->count++;
+	}
+
+	v4l2_ext_control_setup_base(control, id);
+	v4l2_ext_control_setup_value(control, value);
+
+	return 0;
+}
+
+int v4l2_encoder_controls_commit(struct v4l2_encoder *encoder,
+				 struct v4l2_encoder_controls *controls,
+				 int request_fd)
+{
+	struct v4l2_ext_controls ext_controls = { 0 };
+	int ret;
+
+	if (!encoder || !controls)
+		return -EINVAL;
+
+	if (!controls->count)
+		return 0;
+
+	v4l2_ext_controls_setup(&ext_controls, controls->controls,
+				controls->count);
+
+	if (request_fd >= 0) {
+		v4l2_ext_controls_request_attach(&ext_controls, request_fd);
+	} else {
+		/* Validate first to report which control is rejected. */
+		ret = v4l2_ext_controls_try(encoder->video_fd, &ext_controls);
+		if (ret) {
+			if (ext_controls.error_idx < controls->count)
+				fprintf(stderr, "Invalid control %#x\n",
+					controls->controls[ext_controls.error_idx].id);
+			else
+				fprintf(stderr, "Invalid controls\n");
+
+			return ret;
+		}
+	}
+
+	ret = v4l2_ext_controls_set(encoder->video_fd, &ext_controls);
+	if (ret) {
+		fprintf(stderr, "Failed to set controls\n");
+		return ret;
+	}
+
+	controls->count = 0;
+
+	return 0;
+}
+
+int v4l2_encoder_controls_update(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_controls controls;
+	unsigned int gop_id;
+
+	if (!encoder)
+		return -EINVAL;
+
+	v4l2_encoder_controls_init(&controls);
+
+	gop_id = v4l2_encoder_gop_control(encoder);
+
+	v4l2_encoder_controls_add(&controls,
+				  V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR, 1);
+	v4l2_encoder_controls_add(&controls,
+				  V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP,
+				  encoder->setup.qp_i);
+	v4l2_encoder_controls_add(&controls,
+				  V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP,
+				  encoder->setup.qp_p);
+	v4l2_encoder_controls_add(&controls,
+				  V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE,
+				  V4L2_MPEG_VIDEO_H264_ENTROPY_MODE_CABAC);
+	v4l2_encoder_controls_add(&controls, V4L2_CID_MPEG_VIDEO_GOP_CLOSURE,
+				  encoder->setup.gop_closure);
+	v4l2_encoder_controls_add(&controls, gop_id, encoder->setup.gop_size);
+
+	if (encoder->setup.rc_mode && encoder->rate_control_hardware) {
+		unsigned int mode;
+
+		if (encoder->setup.rc_mode == RATE_CONTROL_MODE_CBR)
+			mode = V4L2_MPEG_VIDEO_BITRATE_MODE_CBR;
+		else
+			mode = V4L2_MPEG_VIDEO_BITRATE_MODE_VBR;
+
+		if (v4l2_encoder_control_check(encoder,
+					       V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE))
+			v4l2_encoder_controls_add(&controls,
+						  V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE,
+						  1);
+
+		v4l2_encoder_controls_add(&controls,
+					  V4L2_CID_MPEG_VIDEO_BITRATE_MODE,
+					  mode);
+		v4l2_encoder_controls_add(&controls, V4L2_CID_MPEG_VIDEO_BITRATE,
+					  encoder->setup.bitrate);
+	}
+
+	return v4l2_encoder_controls_commit(encoder, &controls, -1);
+}
+
+int v4l2_encoder_setup_defaults(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	ret = v4l2_encoder_setup_dimensions(encoder, 1280, 720);
+	if (ret)
+		return ret;
+
+	/* The output format is negotiated at setup time. */
+	ret = v4l2_encoder_setup_format(encoder, 0);
+	if (ret)
+		return ret;
+
+	ret = v4l2_encoder_setup_source(encoder, V4L2_ENCODER_SOURCE_PATTERN);
+	if (ret)
+		return ret;
+
+	ret = v4l2_encoder_setup_fps(encoder, 25);
+	if (ret)
+		return ret;
+
+	ret = v4l2_encoder_setup_qp(encoder, 24, 26);
+	if (ret)
+		return ret;
+
+	ret = v4l2_encoder_setup_gop(encoder, 0, 3);
+	if (ret)
+		return ret;
+
+	ret = v4l2_encoder_setup_keyframe_interval(encoder, 1000);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_dimensions(struct v4l2_encoder *encoder,
+				  unsigned int width, unsigned int height)
+{
+	if (!encoder || !width || !height)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.width = width;
+	encoder->setup.height = height;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_format(struct v4l2_encoder *encoder, uint32_t format)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.format = format;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_source(struct v4l2_encoder *encoder,
+			      unsigned int source)
+{
+	if (!encoder || source > V4L2_ENCODER_SOURCE_FILE)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.source = source;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_source_path(struct v4l2_encoder *encoder,
+				   const char *path)
+{
+	if (!encoder || !path)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.source_path = path;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_source_format(struct v4l2_encoder *encoder,
+				     uint32_t format)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.source_format = format;
+
+	return 0;
+}
+
+/*
+ * Only encoders set up and run from the same thread share a draw buffer,
+ * as one draws and converts a frame before the next takes its turn.
+ */
+int v4l2_encoder_setup_draw_buffer_shared(struct v4l2_encoder *encoder,
+					  bool shared)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.draw_buffer_shared = shared;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_draw_buffer_flags(struct v4l2_encoder *encoder,
+					 unsigned int flags)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.draw_buffer_flags = flags;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_prerender(struct v4l2_encoder *encoder,
+				 unsigned int count)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.prerender_count = count;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_fps(struct v4l2_encoder *encoder, float fps)
+{
+	if (!encoder || !fps)
+		return -EINVAL;
+
+	encoder->setup.fps_den = 1000;
+	encoder->setup.fps_num = fps * encoder->setup.fps_den;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_qp(struct v4l2_encoder *encoder, unsigned int qp_i,
+			  unsigned int qp_p)
+{
+	if (!encoder || !qp_i || !qp_p)
+		return -EINVAL;
+
+	encoder->setup.qp_i = qp_i;
+	encoder->setup.qp_p = qp_p;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_gop(struct v4l2_encoder *encoder, unsigned int closure,
+			   unsigned int size)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	encoder->setup.gop_closure = closure;
+	encoder->setup.gop_size = size;
+
+	return 0;
+}
+
+static int v4l2_encoder_format_negotiate(struct v4l2_encoder *encoder,
+					 struct v4l2_format *output_format)
+{
+	uint32_t source_format = v4l2_encoder_source_format(encoder);
+	unsigned int width = encoder->setup.width;
+	unsigned int height = encoder->setup.height;
+	struct csc_image image;
+	unsigned int pixelformat;
+	int cost_selected = -1;
+	unsigned int i;
+	int ret;
+
+	/* Drivers that cannot enumerate formats get the historical NV12. */
+	if (!encoder->output_formats_count) {
+		v4l2_format_setup_base(output_format, encoder->output_type);
+		v4l2_format_setup_pixel(output_format, width, height,
+					V4L2_PIX_FMT_NV12);
+		return 0;
+	}
+
+	for (i = 0; i < encoder->output_formats_count; i++) {
+		struct v4l2_encoder_format *candidate =
+			&encoder->output_formats[i];
+		const struct csc_kernel *kernel;
+		struct v4l2_format format;
+		unsigned int bytesperline = 0;
+		int cost;
+
+		if (width < candidate->width_min ||
+		    width > candidate->width_max ||
+		    height < candidate->height_min ||
+		    height > candidate->height_max)
+			continue;
+
+		v4l2_format_setup_base(&format, encoder->output_type);
+		v4l2_format_setup_pixel(&format, width, height,
+					candidate->pixelformat);
+
+		if (!source_format) {
+			/* Unknown source format, prefer NV12. */
+			cost = csc_format_match(candidate->pixelformat,
+						V4L2_PIX_FMT_NV12) ? 0 : 1;
+		} else {
+			kernel = csc_kernel_find(source_format,
+						 candidate->pixelformat);
+			if (!kernel)
+				continue;
+
+			cost = kernel->cost;
+		}
+
+		/* Ask for the source pitch so that frames pass through. */
+		if (source_format &&
+		    csc_format_match(source_format, candidate->pixelformat)) {
+			ret = csc_image_setup(&image, source_format, width,
+					      height, NULL);
+			if (ret < 0)
+				continue;
+
+			v4l2_format_setup_bytesperline(&format, 0,
+						       image.strides[0]);
+		}
+
+		ret = v4l2_format_try(encoder->video_fd, &format);
+		if (ret)
+			continue;
+
+		v4l2_format_bytesperline(&format, 0, &bytesperline);
+
+		/* The pattern is generated at any pitch. */
+		if (source_format &&
+		    csc_format_match(source_format, candidate->pixelformat) &&
+		    (encoder->setup.source == V4L2_ENCODER_SOURCE_PATTERN ||
+		     bytesperline == image.strides[0]))
+			cost = 0;
+
+		if (cost_selected >= 0 && cost >= cost_selected)
+			continue;
+
+		*output_format = format;
+		cost_selected = cost;
+	}
+
+	if (cost_selected < 0)
+		return -EINVAL;
+
+	v4l2_format_pixel(output_format, NULL, NULL, &pixelformat);
+
+	printf("Negotiated output format %.4s with conversion cost %d\n",
+	       (char *)&pixelformat, cost_selected);
+
+	return 0;
+}
+
+int v4l2_encoder_setup_bitrate(struct v4l2_encoder *encoder, unsigned int mode,
+			       unsigned int bitrate, unsigned int vbv_size)
+{
+	if (!encoder || mode > RATE_CONTROL_MODE_VBR || (mode && !bitrate))
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.rc_mode = mode;
+	encoder->setup.bitrate = bitrate;
+	encoder->setup.vbv_size = vbv_size;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_adaptive_qp(struct v4l2_encoder *encoder, bool enable)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.adaptive_qp = enable;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_scene_cut(struct v4l2_encoder *encoder, bool enable)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.scene_cut = enable;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_skip_duplicates(struct v4l2_encoder *encoder,
+				       bool enable)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.skip_duplicates = enable;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_staging(struct v4l2_encoder *encoder, bool enable)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.staging = enable;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_warmup(struct v4l2_encoder *encoder, bool enable)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.warmup = enable;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_pacing(struct v4l2_encoder *encoder, bool enable,
+			      bool drop)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.pacing = enable;
+	encoder->setup.pacing_drop = enable && drop;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_keyframe_interval(struct v4l2_encoder *encoder,
+					 unsigned int interval)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	encoder->setup.keyframe_interval = interval;
+
+	return 0;
+}
+
+/*
+ * Coded pictures at QP 26 fit in a quarter of the raw picture, doubling every
+ * 6 QP steps below. The size never needs to go much over the raw picture.
+ */
+static unsigned int v4l2_encoder_raw_size(struct v4l2_encoder *encoder)
+{
+	unsigned int width = encoder->setup.width;
+	unsigned int height = encoder->setup.height;
+	uint32_t format = encoder->setup.format;
+	struct csc_image image;
+	int raw_size;
+
+	raw_size = csc_image_setup(&image, format ? format : V4L2_PIX_FMT_NV12,
+				   width, height, NULL);
+	if (raw_size <= 0)
+		raw_size = width * height * 3 / 2;
+
+	return raw_size;
+}
+
+/* Even incompressible pictures fit with room for the stream syntax. */
+static unsigned int v4l2_encoder_capture_size_max(struct v4l2_encoder *encoder)
+{
+	unsigned int raw_size = v4l2_encoder_raw_size(encoder);
+
+	return (raw_size + raw_size / 2 + 4095) & ~4095U;
+}
+
+static unsigned int v4l2_encoder_capture_size(struct v4l2_encoder *encoder)
+{
+	unsigned int size_min = 64 * 1024;
+	unsigned int size_max = v4l2_encoder_capture_size_max(encoder);
+	unsigned int raw_size = v4l2_encoder_raw_size(encoder);
+	int qp_i = encoder->setup.qp_i;
+	int qp_p = encoder->setup.qp_p;
+	int qp;
+	double size;
+
+	/* Sized for the finest pictures, as currently picked by the RC. */
+	if (encoder->setup.rc_mode && !encoder->rate_control_hardware &&
+	    encoder->rate_control.mode) {
+		qp_p = rate_control_qp(&encoder->rate_control);
+		qp_i = qp_p - ((int)encoder->setup.qp_p -
+			       (int)encoder->setup.qp_i);
+	}
+
+	qp = qp_i < qp_p ? qp_i : qp_p;
+
+	if (encoder->setup.adaptive_qp)
+		qp -= 3;
+
+	size = raw_size / 4. * pow(2., (26 - qp) / 6.);
+
+	if (size < size_min)
+		size = size_min;
+	else if (size > size_max)
+		size = size_max;
+
+	return ((unsigned int)size + 4095) & ~4095U;
+}
+
+static int v4l2_encoder_capture_format_setup(struct v4l2_encoder *encoder,
+					     unsigned int capture_size)
+{
+	v4l2_format_setup_base(&encoder->capture_format, encoder->capture_type);
+	v4l2_format_setup_pixel(&encoder->capture_format, encoder->setup.width,
+				encoder->setup.height, V4L2_PIX_FMT_H264);
+	v4l2_format_setup_sizeimage(&encoder->capture_format, 0, capture_size);
+
+	return v4l2_format_set(encoder->video_fd, &encoder->capture_format);
+}
+
+static int v4l2_encoder_output_format_setup(struct v4l2_encoder *encoder)
+{
+	unsigned int width = encoder->setup.width;
+	unsigned int height = encoder->setup.height;
+	unsigned int width_coded, height_coded;
+	uint32_t format = encoder->setup.format;
+	int ret;
+
+	if (format) {
+		v4l2_format_setup_base(&encoder->output_format,
+				       encoder->output_type);
+		v4l2_format_setup_pixel(&encoder->output_format, width, height,
+					format);
+	} else {
+		ret = v4l2_encoder_format_negotiate(encoder,
+						    &encoder->output_format);
+		if (ret) {
+			fprintf(stderr, "Failed to negotiate output format\n");
+			return ret;
+		}
+	}
+
+	ret = v4l2_format_set(encoder->video_fd, &encoder->output_format);
+	if (ret)
+		return ret;
+
+	ret = v4l2_format_get(encoder->video_fd, &encoder->output_format);
+	if (ret) {
+		fprintf(stderr, "Failed to get output format\n");
+		return ret;
+	}
+
+	v4l2_format_pixel(&encoder->output_format, &width_coded, &height_coded,
+			  NULL);
+
+	if (width_coded != width || height_coded != height) {
+		struct v4l2_selection selection;
+
+		v4l2_selection_setup_base(&selection, encoder->output_type,
+					  V4L2_SEL_TGT_CROP);
+		v4l2_selection_setup_rect(&selection, 0, 0, width, height);
+
+		ret = v4l2_selection_set(encoder->video_fd, &selection);
+		if (ret) {
+			fprintf(stderr, "Failed to set output selection\n");
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void v4l2_encoder_buffers_cleanup(struct v4l2_encoder *encoder,
+					 unsigned int type)
+{
+	struct v4l2_encoder_buffer *buffers;
+	unsigned int buffers_count;
+	unsigned int i;
+
+	if (type == encoder->output_type) {
+		buffers = encoder->output_buffers;
+		buffers_count = ARRAY_SIZE(encoder->output_buffers);
+		encoder->output_buffers_count = 0;
+		encoder->output_buffers_index = 0;
+	} else {
+		buffers = encoder->capture_buffers;
+		buffers_count = ARRAY_SIZE(encoder->capture_buffers);
+		encoder->capture_buffers_base = 0;
+		encoder->capture_buffers_count = 0;
+		encoder->capture_buffers_index = 0;
+	}
+
+	for (i = 0; i < buffers_count; i++)
+		v4l2_encoder_buffer_cleanup(&buffers[i]);
+
+	v4l2_buffers_destroy(encoder->video_fd, type, encoder->memory);
+}
+
+/*
+ * Non-coherent buffers only get the cache maintenance that is asked for.
+ * Coded data is always read back, so coded buffers always need their
+ * invalidate and are kept coherent.
+ */
+static unsigned int v4l2_encoder_buffers_flags(struct v4l2_encoder *encoder,
+					       unsigned int type)
+{
+	if (encoder->memory != V4L2_MEMORY_MMAP || type != encoder->output_type)
+		return 0;
+
+	if (!v4l2_capabilities_check(encoder->output_capabilities,
+				     V4L2_BUF_CAP_SUPPORTS_MMAP_CACHE_HINTS))
+		return 0;
+
+	return V4L2_MEMORY_FLAG_NON_COHERENT;
+}
+
+static int v4l2_encoder_buffers_setup(struct v4l2_encoder *encoder,
+				      unsigned int type)
+{
+	struct v4l2_encoder_buffer *buffers;
+	struct v4l2_format *format;
+	unsigned int buffers_count;
+	unsigned int flags;
+	unsigned int i;
+	int ret;
+
+	if (type == encoder->output_type) {
+		buffers = encoder->output_buffers;
+		buffers_count = ARRAY_SIZE(encoder->output_buffers);
+		format = &encoder->output_format;
+	} else {
+		buffers = encoder->capture_buffers;
+		buffers_count = V4L2_ENCODER_CAPTURE_BUFFERS;
+		format = &encoder->capture_format;
+	}
+
+	flags = v4l2_encoder_buffers_flags(encoder, type);
+
+	ret = v4l2_buffers_request_flags(encoder->video_fd, type,
+					 encoder->memory, buffers_count,
+					 &flags);
+	if (ret)
+		return ret;
+
+	if (type == encoder->output_type)
+		encoder->output_non_coherent =
+			flags & V4L2_MEMORY_FLAG_NON_COHERENT;
+
+	for (i = 0; i < buffers_count; i++) {
+		struct v4l2_encoder_buffer *buffer = &buffers[i];
+
+		buffer->encoder = encoder;
+		buffer->planes_count = v4l2_format_planes_count(format);
+
+		ret = v4l2_encoder_buffer_setup(buffer, type, i);
+		if (ret)
+			return ret;
+	}
+
+	if (type == encoder->output_type)
+		encoder->output_buffers_count = buffers_count;
+	else
+		encoder->capture_buffers_count = buffers_count;
+
+	return 0;
+}
+
+/*
+ * Larger coded buffers are added with CREATE_BUFS and replace the active
+ * ones, which stay allocated until the queue is released. When there is no
+ * room left, the coded queue is reallocated instead. Growth stops at the
+ * maximum coded size and failures keep the current buffers, so an error
+ * is only returned when the coded queue could not be restored.
+ */
+static int v4l2_encoder_capture_grow(struct v4l2_encoder *encoder)
+{
+	unsigned int base = encoder->capture_buffers_base;
+	unsigned int count = encoder->capture_buffers_count;
+	struct v4l2_format format = encoder->capture_format;
+	unsigned int capture_size;
+	unsigned int capture_size_max;
+	unsigned int capture_size_current;
+	unsigned int created;
+	unsigned int index;
+	unsigned int flags;
+	unsigned int i;
+	int ret;
+
+	v4l2_format_sizeimage(&encoder->capture_format, 0,
+			      &capture_size_current);
+
+	capture_size_max = v4l2_encoder_capture_size_max(encoder);
+	if (capture_size_current >= capture_size_max)
+		return 0;
+
+	capture_size = capture_size_current * 2;
+	if (capture_size > capture_size_max)
+		capture_size = capture_size_max;
+
+	v4l2_format_setup_sizeimage(&format, 0, capture_size);
+
+	if (base + 2 * count <= ARRAY_SIZE(encoder->capture_buffers)) {
+		flags = v4l2_encoder_buffers_flags(encoder,
+						   encoder->capture_type);
+		created = count;
+
+		ret = v4l2_buffers_create_flags(encoder->video_fd,
+						encoder->capture_type,
+						encoder->memory, &format,
+						&created, &index, &flags);
+		if (ret)
+			goto error;
+
+		/* Buffers created short are left unused until released. */
+		if (created != count || index != base + count) {
+			ret = -ENOMEM;
+			goto error;
+		}
+
+		for (i = 0; i < count; i++) {
+			struct v4l2_encoder_buffer *buffer =
+				&encoder->capture_buffers[index + i];
+
+			buffer->encoder = encoder;
+			buffer->planes_count =
+				v4l2_format_planes_count(&format);
+
+			ret = v4l2_encoder_buffer_setup(buffer,
+							encoder->capture_type,
+							index + i);
+			if (ret)
+				break;
+		}
+
+		/* The current buffers stay active until all new ones map. */
+		if (ret) {
+			for (i = 0; i < count; i++)
+				v4l2_encoder_buffer_cleanup(&encoder->capture_buffers[index + i]);
+
+			goto error;
+		}
+
+		for (i = 0; i < count; i++)
+			v4l2_encoder_buffer_cleanup(&encoder->capture_buffers[base + i]);
+
+		/* The driver may have rounded the size of created buffers. */
+		v4l2_buffer_plane_length(&encoder->capture_buffers[index].buffer,
+					 0, &capture_size);
+		v4l2_format_setup_sizeimage(&format, 0, capture_size);
+
+		encoder->capture_buffers_base = index;
+		encoder->capture_buffers_index = 0;
+		encoder->capture_format = format;
+	} else {
+		if (encoder->started) {
+			ret = v4l2_stream_off(encoder->video_fd,
+					      encoder->capture_type);
+			if (ret)
+				goto error;
+		}
+
+		v4l2_encoder_buffers_cleanup(encoder, encoder->capture_type);
+
+		/* The format is updated with the one set by the driver. */
+		ret = v4l2_encoder_capture_format_setup(encoder, capture_size);
+		if (!ret)
+			ret = v4l2_encoder_buffers_setup(encoder,
+							 encoder->capture_type);
+
+		/* Without coded buffers, the previous ones are brought back. */
+		if (ret) {
+			v4l2_encoder_buffers_cleanup(encoder,
+						     encoder->capture_type);
+
+			ret = v4l2_encoder_capture_format_setup(encoder,
+								capture_size_current);
+			if (ret)
+				return ret;
+
+			ret = v4l2_encoder_buffers_setup(encoder,
+							 encoder->capture_type);
+			if (ret)
+				return ret;
+
+			capture_size = 0;
+		}
+
+		if (encoder->started) {
+			ret = v4l2_stream_on(encoder->video_fd,
+					     encoder->capture_type);
+			if (ret)
+				return ret;
+		}
+
+		/* Streaming off the coded queue resets the encoder state. */
+		encoder->frame_params.key_frame = true;
+
+		if (!capture_size)
+			goto error;
+
+		v4l2_format_sizeimage(&encoder->capture_format, 0,
+				      &capture_size);
+	}
 
-	v4l2_format_setup_base(&encoder->capture_format, encoder->capture_type);
-	v4l2_format_setup_pixel(&encoder->capture_format, width, height,
-				V4L2_PIX_FMT_H264);
-	v4l2_format_setup_sizeimage(&encoder->capture_format, 0, capture_size);
+	encoder->stats.coded_growths++;
+
+	printf("Grew coded buffers to %u bytes\n", capture_size);
+
+	return 0;
+
+error:
+	fprintf(stderr, "Failed to grow coded buffers, keeping %u bytes\n",
+		capture_size_current);
+
+	return 0;
+}
+
+static void v4l2_encoder_source_cleanup(struct v4l2_encoder *encoder)
+{
+	v4l2_encoder_frame_cache_cleanup(encoder);
+	v4l2_encoder_prerender_cleanup(encoder);
+
+	analysis_cleanup(&encoder->analysis);
+
+	if (encoder->source_data) {
+		free(encoder->source_data);
+		encoder->source_data = NULL;
+	}
+
+	if (encoder->staging_data) {
+		free(encoder->staging_data);
+		encoder->staging_data = NULL;
+	}
+
+	if (encoder->draw_buffer) {
+		draw_buffer_put(encoder->draw_buffer);
+		encoder->draw_buffer = NULL;
+	}
+}
+
+/* Everything derived from the picture dimensions and format. */
+static int v4l2_encoder_source_setup(struct v4l2_encoder *encoder)
+{
+	unsigned int width = encoder->setup.width;
+	unsigned int height = encoder->setup.height;
+	unsigned int width_coded, height_coded;
+	struct csc_image image;
+	uint32_t source_format;
+	uint32_t format;
+	int ret;
+
+	v4l2_format_pixel(&encoder->output_format, &width_coded, &height_coded,
+			  &format);
+
+	/* Frame analysis, on every fourth luma row */
+
+	if (encoder->setup.adaptive_qp || encoder->setup.scene_cut) {
+		ret = analysis_init(&encoder->analysis, width, height, 4);
+		if (ret)
+			goto error;
+	}
+
+	/* Draw buffer, only for sources rendered in RGB */
+
+	if (v4l2_encoder_source_rgb(encoder->setup.source)) {
+		unsigned int flags = encoder->setup.draw_buffer_flags;
+
+		if (encoder->setup.draw_buffer_shared)
+			encoder->draw_buffer = draw_buffer_get(width, height,
+							       flags);
+		else
+			encoder->draw_buffer = draw_buffer_create(width, height,
+								  flags);
+
+		if (!encoder->draw_buffer) {
+			fprintf(stderr, "Failed to create draw buffer\n");
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+
+	/* Mandelbrot */
+
+	draw_mandelbrot_init(&encoder->draw_mandelbrot);
+
+	/* Conversion */
+
+	source_format = v4l2_encoder_source_format(encoder);
+
+	encoder->csc_kernel = csc_kernel_find(source_format, format);
+	if (!encoder->csc_kernel) {
+		fprintf(stderr, "Unsupported source to output format conversion\n");
+		ret = -EINVAL;
+		goto error;
+	}
+
+	/* Staging for sources that are not converted from the draw buffer. */
+
+	if (encoder->setup.source == V4L2_ENCODER_SOURCE_FILE ||
+	    encoder->setup.source == V4L2_ENCODER_SOURCE_PATTERN) {
+		int size;
+
+		size = csc_image_setup(&image, source_format, width_coded,
+				       height_coded, NULL);
+		if (size < 0) {
+			ret = size;
+			goto error;
+		}
+
+		encoder->source_data = malloc(size);
+		if (!encoder->source_data) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+
+	/* Scratch lines for staged writes to the output buffers */
+
+	if (encoder->setup.staging) {
+		void *planes[VIDEO_MAX_PLANES] = { NULL };
+		unsigned int size;
+
+		ret = v4l2_encoder_output_image(encoder, planes, &image);
+		if (ret)
+			goto error;
+
+		/* The test pattern stages a luma and a chroma line. */
+		size = csc_staging_size(&image);
+		if (size < 2 * width)
+			size = 2 * width;
+
+		encoder->staging_data = malloc(size);
+		if (!encoder->staging_data) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+
+	/* Pre-rendered frames */
+
+	if (encoder->setup.prerender_count) {
+		ret = v4l2_encoder_prerender_setup(encoder);
+		if (ret) {
+			fprintf(stderr, "Failed to pre-render frames\n");
+			goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	v4l2_encoder_source_cleanup(encoder);
+
+	return ret;
+}
 
-	ret = v4l2_format_set(encoder->video_fd, &encoder->capture_format);
+int v4l2_encoder_setup(struct v4l2_encoder *encoder)
+{
+	struct v4l2_streamparm streamparm;
+	int ret;
+
+	if (!encoder || encoder->up)
+		return -EINVAL;
+
+	/* Setup capture format. */
+
+	ret = v4l2_encoder_capture_format_setup(encoder,
+						v4l2_encoder_capture_size(encoder));
 	if (ret) {
 		fprintf(stderr, "Failed to set capture format\n");
 		goto complete;
@@ -563,218 +3044,436 @@ int v4l2_encoder_setup(struct v4l2_encoder *encoder)
 
 	/* Setup output format. */
 
-	v4l2_format_setup_base(&encoder->output_format, encoder->output_type);
-	v4l2_format_setup_pixel(&encoder->output_format, width, height, format);
-
-	ret = v4l2_format_set(encoder->video_fd, &encoder->output_format);
+	ret = v4l2_encoder_output_format_setup(encoder);
 	if (ret) {
 		fprintf(stderr, "Failed to set output format\n");
 		goto complete;
 	}
 
-	ret = v4l2_format_get(encoder->video_fd, &encoder->output_format);
+	/* Allocate capture buffers. */
+
+	ret = v4l2_encoder_buffers_setup(encoder, encoder->capture_type);
 	if (ret) {
-		fprintf(stderr, "Failed to get output format\n");
-		goto complete;
+		fprintf(stderr, "Failed to allocate capture buffers\n");
+		goto error;
 	}
 
-	v4l2_format_pixel(&encoder->output_format, &width_coded, &height_coded,
-			  NULL);
-
-	if (width_coded != width || height_coded != height) {
-		struct v4l2_selection selection;
+	/* Allocate output buffers */
 
-		v4l2_selection_setup_base(&selection, encoder->output_type,
-					  V4L2_SEL_TGT_CROP);
-		v4l2_selection_setup_rect(&selection, 0, 0, width, height);
+	ret = v4l2_encoder_buffers_setup(encoder, encoder->output_type);
+	if (ret) {
+		fprintf(stderr, "Failed to allocate output buffers\n");
+		goto error;
+	}
 
-		ret = v4l2_selection_set(encoder->video_fd, &selection);
-		if (ret) {
-			fprintf(stderr, "Failed to set output selection\n");
-			goto complete;
+	/* Rate control */
+
+	if (encoder->setup.rc_mode) {
+		encoder->rate_control_hardware =
+			v4l2_encoder_control_check(encoder,
+						   V4L2_CID_MPEG_VIDEO_BITRATE) &&
+			v4l2_encoder_control_check(encoder,
+						   V4L2_CID_MPEG_VIDEO_BITRATE_MODE);
+
+		if (!encoder->rate_control_hardware) {
+			printf("Using userspace rate control\n");
+
+			ret = rate_control_init(&encoder->rate_control,
+						encoder->setup.rc_mode,
+						encoder->setup.bitrate,
+						encoder->setup.vbv_size,
+						encoder->setup.fps_num,
+						encoder->setup.fps_den,
+						encoder->setup.qp_p);
+			if (ret)
+				goto error;
 		}
 	}
 
-	/* Allocate capture buffers. */
+	/* Controls */
+
+	ret = v4l2_encoder_controls_update(encoder);
+	if (ret)
+		goto error;
+
+	/* Parm */
 
-	buffers_count = ARRAY_SIZE(encoder->capture_buffers);
+	v4l2_parm_setup_base(&streamparm, encoder->output_type);
+	streamparm.parm.output.timeperframe.numerator = encoder->setup.fps_num;
+	streamparm.parm.output.timeperframe.denominator = encoder->setup.fps_den;
 
-	ret = v4l2_buffers_request(encoder->video_fd, encoder->capture_type,
-				   encoder->memory, buffers_count);
+	ret = v4l2_parm_set(encoder->video_fd, &streamparm);
 	if (ret) {
-		fprintf(stderr, "Failed to allocate capture buffers\n");
+		fprintf(stderr, "Failed to set output parm\n");
 		goto error;
 	}
 
-	for (i = 0; i < buffers_count; i++) {
-		struct v4l2_encoder_buffer *buffer = &encoder->capture_buffers[i];
+	/* Source file */
 
-		buffer->encoder = encoder;
-		buffer->planes_count =
-			v4l2_format_planes_count(&encoder->capture_format);
+	if (encoder->setup.source == V4L2_ENCODER_SOURCE_FILE) {
+		struct stat source_stat;
+
+		if (!encoder->setup.source_path) {
+			fprintf(stderr, "Missing source file path\n");
+			ret = -EINVAL;
+			goto error;
+		}
 
-		ret = v4l2_encoder_buffer_setup(buffer, encoder->capture_type, i);
+		encoder->source_fd = open(encoder->setup.source_path, O_RDONLY);
+		if (encoder->source_fd < 0) {
+			fprintf(stderr, "Failed to open source file\n");
+			ret = -errno;
+			goto error;
+		}
+
+		ret = fstat(encoder->source_fd, &source_stat);
 		if (ret) {
-			fprintf(stderr, "Failed to setup capture buffer\n");
+			ret = -errno;
 			goto error;
 		}
+
+		encoder->source_size = source_stat.st_size;
 	}
 
-	encoder->capture_buffers_count = buffers_count;
+	/* Source */
 
-	/* Allocate output buffers */
+	ret = v4l2_encoder_source_setup(encoder);
+	if (ret)
+		goto error;
+
+	encoder->up = true;
 
-	buffers_count = ARRAY_SIZE(encoder->output_buffers);
+	ret = 0;
+	goto complete;
 
-	ret = v4l2_buffers_request(encoder->video_fd, encoder->output_type,
-				   encoder->memory, buffers_count);
-	if (ret) {
-		fprintf(stderr, "Failed to allocate output buffers\n");
-		goto complete;
+error:
+	v4l2_encoder_source_cleanup(encoder);
+
+	if (encoder->source_fd >= 0) {
+		close(encoder->source_fd);
+		encoder->source_fd = -1;
 	}
 
-	for (i = 0; i < buffers_count; i++) {
+	v4l2_encoder_buffers_cleanup(encoder, encoder->output_type);
+	v4l2_encoder_buffers_cleanup(encoder, encoder->capture_type);
+
+complete:
+	return ret;
+}
+
+int v4l2_encoder_cleanup(struct v4l2_encoder *encoder)
+{
+	if (!encoder || !encoder->up)
+		return -EINVAL;
+
+	/* Cleanup output and capture buffers. */
+
+	v4l2_encoder_buffers_cleanup(encoder, encoder->output_type);
+	v4l2_encoder_buffers_cleanup(encoder, encoder->capture_type);
+
+	/* Cleanup source. */
+
+	v4l2_encoder_source_cleanup(encoder);
+
+	if (encoder->source_fd >= 0) {
+		close(encoder->source_fd);
+		encoder->source_fd = -1;
+	}
+
+	if (encoder->coded_data) {
+		free(encoder->coded_data);
+		encoder->coded_data = NULL;
+		encoder->coded_data_size = 0;
+	}
+
+	encoder->up = false;
+
+	return 0;
+}
+
+static bool v4l2_encoder_output_buffers_fit(struct v4l2_encoder *encoder)
+{
+	unsigned int planes_count;
+	unsigned int i, j;
+
+	planes_count = v4l2_format_planes_count(&encoder->output_format);
+
+	for (i = 0; i < encoder->output_buffers_count; i++) {
 		struct v4l2_encoder_buffer *buffer = &encoder->output_buffers[i];
 
-		buffer->encoder = encoder;
-		buffer->planes_count =
-			v4l2_format_planes_count(&encoder->output_format);
+		if (buffer->planes_count != planes_count)
+			return false;
 
-		ret = v4l2_encoder_buffer_setup(buffer, encoder->output_type, i);
-		if (ret) {
-			fprintf(stderr, "Failed to setup output buffer\n");
-			goto error;
+		for (j = 0; j < planes_count; j++) {
+			unsigned int sizeimage;
+			unsigned int length;
+
+			v4l2_format_sizeimage(&encoder->output_format, j,
+					      &sizeimage);
+			v4l2_buffer_plane_length(&buffer->buffer, j, &length);
+
+			if (length < sizeimage)
+				return false;
 		}
 	}
 
-	encoder->output_buffers_count = buffers_count;
+	return encoder->output_buffers_count > 0;
+}
 
-	/* Controls */
+/* Staging is measured on the mapped device buffers, as used to encode. */
+int v4l2_encoder_bench(struct v4l2_encoder *encoder, unsigned int frames)
+{
+	struct v4l2_encoder_buffer *output_buffer;
+	struct v4l2_encoder_buffer *capture_buffer;
+	struct draw_mandelbrot mandelbrot;
+	struct draw_buffer *buffer;
+	struct csc_image dst;
+	unsigned int width, height;
+	unsigned int pixelformat;
+	unsigned int coded_size = 0;
+	int ret;
 
-	ret = v4l2_encoder_control_set(encoder,
-				       V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR,
-				       1);
-	if (ret)
-		goto error;
+	if (!encoder || !encoder->up || encoder->memory != V4L2_MEMORY_MMAP)
+		return -EINVAL;
 
-	ret = v4l2_encoder_control_set(encoder,
-				       V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP,
-				       encoder->setup.qp_i);
-	if (ret)
-		goto error;
+	output_buffer = &encoder->output_buffers[0];
+	capture_buffer =
+		&encoder->capture_buffers[encoder->capture_buffers_base];
 
-	ret = v4l2_encoder_control_set(encoder,
-				       V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP,
-				       encoder->setup.qp_p);
+	ret = v4l2_encoder_output_image(encoder, output_buffer->mmap_data,
+					&dst);
 	if (ret)
-		goto error;
+		return ret;
 
-	ret = v4l2_encoder_control_set(encoder,
-				       V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE,
-				       V4L2_MPEG_VIDEO_H264_ENTROPY_MODE_CABAC);
-	if (ret)
+	v4l2_format_pixel(&encoder->output_format, &width, &height,
+			  &pixelformat);
+
+	/* Same coded size as the malloc baseline, within the buffer. */
+	v4l2_buffer_plane_length(&capture_buffer->buffer, 0, &coded_size);
+	if (coded_size > width * height / 4)
+		coded_size = width * height / 4;
+
+	buffer = draw_buffer_create(width, height, DRAW_BUFFER_ALIGNED);
+	if (!buffer)
+		return -ENOMEM;
+
+	draw_mandelbrot_init(&mandelbrot);
+	draw_mandelbrot(&mandelbrot, buffer);
+
+	ret = bench_staging("device", buffer, &dst, frames,
+			    capture_buffer->mmap_data[0], coded_size);
+
+	draw_buffer_destroy(buffer);
+
+	return ret;
+}
+
+int v4l2_encoder_reconfigure(struct v4l2_encoder *encoder, unsigned int width,
+			     unsigned int height, uint32_t format)
+{
+	struct v4l2_encoder_setup setup;
+	struct timespec time_before, time_after;
+	unsigned int capture_size;
+	unsigned int capture_length = 0;
+	unsigned int sizeimage = 0;
+	bool started;
+	unsigned int i;
+	int ret;
+
+	if (!encoder || !encoder->up || !width || !height)
+		return -EINVAL;
+
+	setup = encoder->setup;
+
+	clock_gettime(CLOCK_MONOTONIC, &time_before);
+
+	started = encoder->started;
+	if (started) {
+		ret = v4l2_encoder_stop(encoder);
+		if (ret)
+			return ret;
+	}
+
+	encoder->setup.width = width;
+	encoder->setup.height = height;
+	encoder->setup.format = format;
+
+	capture_size = v4l2_encoder_capture_size(encoder);
+
+	v4l2_buffer_plane_length(&encoder->capture_buffers[encoder->capture_buffers_base].buffer,
+				 0, &capture_length);
+
+	/* Coded buffers are kept when large enough for the new size. */
+	if (capture_size <= capture_length) {
+		ret = v4l2_encoder_capture_format_setup(encoder, capture_size);
+
+		/* The format in use is read back when it cannot change. */
+		if (ret == -EBUSY) {
+			ret = v4l2_format_get(encoder->video_fd,
+					      &encoder->capture_format);
+			if (!ret)
+				v4l2_format_sizeimage(&encoder->capture_format,
+						      0, &sizeimage);
+		}
+
+		if (!ret && sizeimage && sizeimage < capture_size)
+			capture_length = 0;
+	}
+
+	if (capture_size > capture_length) {
+		v4l2_encoder_buffers_cleanup(encoder, encoder->capture_type);
+
+		ret = v4l2_encoder_capture_format_setup(encoder, capture_size);
+		if (!ret)
+			ret = v4l2_encoder_buffers_setup(encoder,
+							 encoder->capture_type);
+	}
+
+	if (ret) {
+		fprintf(stderr, "Failed to set capture format\n");
 		goto error;
+	}
 
-	ret = v4l2_encoder_control_set(encoder, V4L2_CID_MPEG_VIDEO_GOP_CLOSURE,
-				       encoder->setup.gop_closure);
-	if (ret)
+	/*
+	 * Drivers refuse a new format while buffers are allocated, in which
+	 * case the output buffers are released first. Otherwise they are kept
+	 * as long as they can hold the new picture.
+	 */
+	ret = v4l2_encoder_output_format_setup(encoder);
+	if (ret == -EBUSY) {
+		v4l2_encoder_buffers_cleanup(encoder, encoder->output_type);
+		ret = v4l2_encoder_output_format_setup(encoder);
+	} else if (!ret && !v4l2_encoder_output_buffers_fit(encoder)) {
+		v4l2_encoder_buffers_cleanup(encoder, encoder->output_type);
+	}
+
+	if (ret) {
+		fprintf(stderr, "Failed to set output format\n");
 		goto error;
+	}
 
-	if (encoder->setup.gop_closure) {
-		ret = v4l2_encoder_control_set(encoder,
-					       V4L2_CID_MPEG_VIDEO_GOP_SIZE,
-					       encoder->setup.gop_size);
-		if (ret)
-			goto error;
-	} else {
-		ret = v4l2_encoder_control_set(encoder,
-					       V4L2_CID_MPEG_VIDEO_H264_I_PERIOD,
-					       encoder->setup.gop_size);
-		if (ret)
+	if (!encoder->output_buffers_count) {
+		ret = v4l2_encoder_buffers_setup(encoder, encoder->output_type);
+		if (ret) {
+			fprintf(stderr, "Failed to allocate output buffers\n");
 			goto error;
+		}
 	}
 
-	/* Parm */
+	/* Nothing drawn for the previous dimensions can be reused. */
 
-	v4l2_parm_setup_base(&streamparm, encoder->output_type);
-	streamparm.parm.output.timeperframe.numerator = encoder->setup.fps_num;
-	streamparm.parm.output.timeperframe.denominator = encoder->setup.fps_den;
+	v4l2_encoder_source_cleanup(encoder);
 
-	ret = v4l2_parm_set(encoder->video_fd, &streamparm);
-	if (ret) {
-		fprintf(stderr, "Failed to set output parm\n");
-		goto error;
+	for (i = 0; i < encoder->output_buffers_count; i++) {
+		struct v4l2_encoder_buffer *buffer = &encoder->output_buffers[i];
+
+		buffer->drawn = false;
+		buffer->cache_generation = 0;
+		buffer->prerender_slot = 0;
 	}
 
-	/* Draw buffer */
+	encoder->x = 0;
+	encoder->y = 0;
+	encoder->background_drawn = false;
+	encoder->frame_hash_valid = false;
 
-	encoder->draw_buffer = draw_buffer_create(width, height);
-	if (!encoder->draw_buffer) {
-		fprintf(stderr, "Failed to create draw buffer\n");
+	ret = v4l2_encoder_source_setup(encoder);
+	if (ret)
 		goto error;
-	}
 
-	/* Mandelbrot */
+	/* Some drivers reset controls along with the format. */
+	ret = v4l2_encoder_controls_update(encoder);
+	if (ret)
+		goto error;
 
-	draw_mandelbrot_init(&encoder->draw_mandelbrot);
+	/* Pending parameters were for the previous stream, which ends here. */
+	memset(&encoder->frame_params, 0, sizeof(encoder->frame_params));
+	encoder->frame_params.key_frame = true;
+	encoder->qp_offset = 0;
 
-	encoder->up = true;
+	/* Warming up again would defeat switching quickly. */
+	if (started) {
+		ret = v4l2_encoder_stream_on(encoder);
+		if (ret)
+			goto error;
+	}
 
-	ret = 0;
-	goto complete;
+	clock_gettime(CLOCK_MONOTONIC, &time_after);
 
-error:
-	buffers_count = ARRAY_SIZE(encoder->output_buffers);
+	printf("Reconfigured to %ux%u in %llu us\n", width, height,
+	       timespec_diff(time_before, time_after) / 1000ULL);
 
-	for (i = 0; i < buffers_count; i++)
-		v4l2_encoder_buffer_cleanup(&encoder->output_buffers[i]);
+	return 0;
 
-	v4l2_buffers_destroy(encoder->video_fd, encoder->output_type,
-			     encoder->memory);
+error:
+	fprintf(stderr, "Failed to reconfigure encoder\n");
 
-	buffers_count = ARRAY_SIZE(encoder->capture_buffers);
+	/* Leave the encoder torn down, to be set up again as it was. */
+	if (encoder->started)
+		v4l2_encoder_stop(encoder);
 
-	for (i = 0; i < buffers_count; i++)
-		v4l2_encoder_buffer_cleanup(&encoder->capture_buffers[i]);
+	v4l2_encoder_cleanup(encoder);
 
-	v4l2_buffers_destroy(encoder->video_fd, encoder->capture_type,
-			     encoder->memory);
+	encoder->setup = setup;
 
-complete:
 	return ret;
 }
 
-int v4l2_encoder_cleanup(struct v4l2_encoder *encoder)
+static void v4l2_encoder_formats_probe(struct v4l2_encoder *encoder)
 {
-	unsigned int buffers_count;
-	unsigned int i;
-
-	if (!encoder || !encoder->up)
-		return -EINVAL;
-
-	/* Cleanup output buffers. */
-
-	buffers_count = ARRAY_SIZE(encoder->output_buffers);
-
-	for (i = 0; i < buffers_count; i++)
-		v4l2_encoder_buffer_cleanup(&encoder->output_buffers[i]);
-
-	v4l2_buffers_destroy(encoder->video_fd, encoder->output_type,
-			     encoder->memory);
+	unsigned int formats_count = ARRAY_SIZE(encoder->output_formats);
+	unsigned int count = 0;
+	unsigned int index;
+	int ret;
 
-	/* Cleanup capture buffers. */
+	for (index = 0; count < formats_count; index++) {
+		struct v4l2_encoder_format *format =
+			&encoder->output_formats[count];
+		struct v4l2_frmsizeenum frame_size;
+		unsigned int pixelformat;
 
-	buffers_count = ARRAY_SIZE(encoder->capture_buffers);
+		ret = v4l2_pixel_format_enum(encoder->video_fd,
+					     encoder->output_type, index,
+					     &pixelformat, NULL);
+		if (ret)
+			break;
 
-	for (i = 0; i < buffers_count; i++)
-		v4l2_encoder_buffer_cleanup(&encoder->capture_buffers[i]);
+		format->pixelformat = pixelformat;
+
+		/* Sizes that cannot be enumerated are not constrained. */
+		format->width_min = 1;
+		format->width_max = ~0U;
+		format->width_step = 1;
+		format->height_min = 1;
+		format->height_max = ~0U;
+		format->height_step = 1;
+
+		ret = v4l2_frame_size_enum(encoder->video_fd, pixelformat, 0,
+					   &frame_size);
+		if (!ret && frame_size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			format->width_min = frame_size.discrete.width;
+			format->width_max = frame_size.discrete.width;
+			format->height_min = frame_size.discrete.height;
+			format->height_max = frame_size.discrete.height;
+		} else if (!ret) {
+			format->width_min = frame_size.stepwise.min_width;
+			format->width_max = frame_size.stepwise.max_width;
+			format->width_step = frame_size.stepwise.step_width;
+			format->height_min = frame_size.stepwise.min_height;
+			format->height_max = frame_size.stepwise.max_height;
+			format->height_step = frame_size.stepwise.step_height;
+		}
 
-	v4l2_buffers_destroy(encoder->video_fd, encoder->capture_type,
-			     encoder->memory);
+		printf("Output format %.4s from %ux%u to %ux%u in %ux%u steps\n",
+		       (char *)&pixelformat, format->width_min,
+		       format->height_min, format->width_max,
+		       format->height_max, format->width_step,
+		       format->height_step);
 
-	encoder->up = false;
+		count++;
+	}
 
-	return 0;
+	encoder->output_formats_count = count;
 }
 
 int v4l2_encoder_probe(struct v4l2_encoder *encoder)
@@ -846,6 +3545,10 @@ int v4l2_encoder_probe(struct v4l2_encoder *encoder)
 	if (ret)
 		return ret;
 
+	/* Enumerate picture pixel formats. */
+
+	v4l2_encoder_formats_probe(encoder);
+
 	/* Check coded pixel format. */
 
 	check = v4l2_pixel_format_check(encoder->video_fd,
@@ -862,21 +3565,17 @@ int v4l2_encoder_probe(struct v4l2_encoder *encoder)
 }
 
 static int media_device_probe(struct v4l2_encoder *encoder, struct udev *udev,
-			      struct udev_device *device, int function)
+			      const char *path, int function)
 {
-	const char *path = udev_device_get_devnode(device);
 	struct media_device_info device_info = { 0 };
 	struct media_v2_topology topology = { 0 };
-	struct media_v2_interface *interfaces = NULL;
-	struct media_v2_entity *entities = NULL;
-	struct media_v2_pad *pads = NULL;
-	struct media_v2_link *links = NULL;
 	struct media_v2_entity *encoder_entity;
 	struct media_v2_interface *encoder_interface;
 	struct media_v2_pad *sink_pad;
 	struct media_v2_link *sink_link;
 	struct media_v2_pad *source_pad;
 	struct media_v2_link *source_link;
+	struct udev_device *device = NULL;
 	const char *driver = "cedrus";
 	int media_fd = -1;
 	int video_fd = -1;
@@ -892,52 +3591,13 @@ static int media_device_probe(struct v4l2_encoder *encoder, struct udev *udev,
 		goto error;
 
 	ret = strncmp(device_info.driver, driver, strlen(driver));
-	if (ret)
-		goto error;
-
-	ret = media_topology_get(media_fd, &topology);
-	if (ret)
-		goto error;
-
-	if (!topology.num_interfaces || !topology.num_entities ||
-	    !topology.num_pads || !topology.num_links) {
+	if (ret) {
 		ret = -ENODEV;
 		goto error;
 	}
 
-	interfaces = calloc(1, topology.num_interfaces * sizeof(*interfaces));
-	if (!interfaces) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	topology.ptr_interfaces = (__u64)interfaces;
-
-	entities = calloc(1, topology.num_entities * sizeof(*entities));
-	if (!entities) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	topology.ptr_entities = (__u64)entities;
-
-	pads = calloc(1, topology.num_pads * sizeof(*pads));
-	if (!pads) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	topology.ptr_pads = (__u64)pads;
-
-	links = calloc(1, topology.num_links * sizeof(*links));
-	if (!links) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	topology.ptr_links = (__u64)links;
-
-	ret = media_topology_get(media_fd, &topology);
+	/* Decoder and encoder graphs are small enough for a single fetch. */
+	ret = media_topology_fetch(media_fd, &topology, 16);
 	if (ret)
 		goto error;
 
@@ -1016,42 +3676,37 @@ error:
 		close(video_fd);
 
 complete:
-	if (links)
-		free(links);
-
-	if (pads)
-		free(pads);
-
-	if (entities)
-		free(entities);
+	if (device)
+		udev_device_unref(device);
 
-	if (interfaces)
-		free(interfaces);
+	media_topology_release(&topology);
 
 	return ret;
 }
 
-int v4l2_encoder_open(struct v4l2_encoder *encoder)
+static int v4l2_encoder_devices_discover(struct v4l2_encoder *encoder,
+					 const char *media_path)
 {
 	struct udev *udev = NULL;
 	struct udev_enumerate *enumerate = NULL;
 	struct udev_list_entry *devices;
 	struct udev_list_entry *entry;
-	int ret;
-
-	if (!encoder)
-		return -EINVAL;
-
-	encoder->media_fd = -1;
-	encoder->video_fd = -1;
+	int ret = -ENODEV;
 
 	udev = udev_new();
 	if (!udev)
-		goto error;
+		goto complete;
+
+	/* An explicit media device only needs its graph to be walked. */
+	if (media_path) {
+		ret = media_device_probe(encoder, udev, media_path,
+					 MEDIA_ENT_F_PROC_VIDEO_ENCODER);
+		goto complete;
+	}
 
 	enumerate = udev_enumerate_new(udev);
 	if (!enumerate)
-		goto error;
+		goto complete;
 
 	udev_enumerate_add_match_subsystem(enumerate, "media");
 	udev_enumerate_scan_devices(enumerate);
@@ -1070,8 +3725,10 @@ int v4l2_encoder_open(struct v4l2_encoder *encoder)
 		if (!device)
 			continue;
 
-		ret = media_device_probe(encoder, udev, device,
-					 MEDIA_ENT_F_PROC_VIDEO_ENCODER);
+		path = udev_device_get_devnode(device);
+		if (path)
+			ret = media_device_probe(encoder, udev, path,
+						 MEDIA_ENT_F_PROC_VIDEO_ENCODER);
 
 		udev_device_unref(device);
 
@@ -1079,13 +3736,170 @@ int v4l2_encoder_open(struct v4l2_encoder *encoder)
 			break;
 	}
 
+complete:
+	if (enumerate)
+		udev_enumerate_unref(enumerate);
+
+	if (udev)
+		udev_unref(udev);
+
+	return ret;
+}
+
+/* Open known device nodes, checking they still belong to the encoder. */
+static int v4l2_encoder_devices_open(struct v4l2_encoder *encoder,
+				     const char *media_path,
+				     const char *video_path,
+				     const char *bus_info)
+{
+	struct media_device_info device_info = { 0 };
+	const char *driver = "cedrus";
+	char video_driver[32] = { 0 };
+	unsigned int capabilities;
+	unsigned int type;
+	int media_fd = -1;
+	int video_fd = -1;
+	int ret;
+
+	media_fd = open(media_path, O_RDWR);
+	if (media_fd < 0)
+		return -errno;
+
+	ret = media_device_info(media_fd, &device_info);
+	if (ret)
+		goto error;
+
+	if (strncmp(device_info.driver, driver, strlen(driver)) ||
+	    (bus_info && strncmp(device_info.bus_info, bus_info,
+				 sizeof(device_info.bus_info)))) {
+		ret = -ENODEV;
+		goto error;
+	}
+
+	video_fd = open(video_path, O_RDWR | O_NONBLOCK);
+	if (video_fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	ret = v4l2_capabilities_probe(video_fd, &capabilities, video_driver,
+				      NULL);
+	if (ret)
+		goto error;
+
+	if (strncmp(video_driver, driver, strlen(driver))) {
+		ret = -ENODEV;
+		goto error;
+	}
+
+	/* Other video nodes of the driver are not memory-to-memory. */
+	if (!v4l2_capabilities_check(capabilities, V4L2_CAP_VIDEO_M2M) &&
+	    !v4l2_capabilities_check(capabilities, V4L2_CAP_VIDEO_M2M_MPLANE)) {
+		ret = -ENODEV;
+		goto error;
+	}
+
+	type = v4l2_capabilities_check(capabilities,
+				       V4L2_CAP_VIDEO_M2M_MPLANE) ?
+	       V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (!v4l2_pixel_format_check(video_fd, type, V4L2_PIX_FMT_H264)) {
+		ret = -ENODEV;
+		goto error;
+	}
+
+	encoder->media_fd = media_fd;
+	encoder->video_fd = video_fd;
+
+	return 0;
+
+error:
+	if (media_fd >= 0)
+		close(media_fd);
+
+	if (video_fd >= 0)
+		close(video_fd);
+
+	return ret;
+}
+
+static int v4l2_encoder_cache_load(struct v4l2_encoder *encoder,
+				   const char *cache_path)
+{
+	char media_path[256], video_path[256];
+	char bus_info[32];
+	FILE *file;
+	int ret = -ENOENT;
+
+	file = fopen(cache_path, "r");
+	if (!file)
+		return -errno;
+
+	while (fscanf(file, "%31s %255s %255s", bus_info, media_path,
+		      video_path) == 3) {
+		ret = v4l2_encoder_devices_open(encoder, media_path,
+						video_path,
+						strcmp(bus_info, "-") ?
+						bus_info : NULL);
+		if (!ret)
+			break;
+	}
+
+	fclose(file);
+
+	return ret;
+}
+
+static void v4l2_encoder_cache_store(struct v4l2_encoder *encoder,
+				     const char *cache_path)
+{
+	struct media_device_info device_info = { 0 };
+	char media_path[256] = { 0 };
+	char video_path[256] = { 0 };
+	char fd_path[32];
+	FILE *file;
+	int ret;
+
+	ret = media_device_info(encoder->media_fd, &device_info);
+	if (ret)
+		return;
+
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d",
+		 encoder->media_fd);
+	if (readlink(fd_path, media_path, sizeof(media_path) - 1) < 0)
+		return;
+
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d",
+		 encoder->video_fd);
+	if (readlink(fd_path, video_path, sizeof(video_path) - 1) < 0)
+		return;
+
+	file = fopen(cache_path, "w");
+	if (!file) {
+		fprintf(stderr, "Failed to write discovery cache\n");
+		return;
+	}
+
+	fprintf(file, "%s %s %s\n", device_info.bus_info[0] ?
+		device_info.bus_info : "-", media_path, video_path);
+
+	fclose(file);
+}
+
+static int v4l2_encoder_open_complete(struct v4l2_encoder *encoder)
+{
+	struct timespec time;
+	int ret;
+
 	if (encoder->media_fd < 0) {
 		fprintf(stderr, "Failed to open encoder media device\n");
+		ret = -ENODEV;
 		goto error;
 	}
 
 	if (encoder->video_fd < 0) {
 		fprintf(stderr, "Failed to open encoder video device\n");
+		ret = -ENODEV;
 		goto error;
 	}
 
@@ -1097,30 +3911,107 @@ int v4l2_encoder_open(struct v4l2_encoder *encoder)
 		goto error;
 	}
 
-	ret = 0;
-	goto complete;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	printf("Opened encoder devices in %llu us\n",
+	       timespec_diff(encoder->open_time, time) / 1000ULL);
+
+	return 0;
 
 error:
-	if (encoder->media_fd) {
+	if (encoder->media_fd >= 0) {
 		close(encoder->media_fd);
 		encoder->media_fd = -1;
 	}
 
-	if (encoder->video_fd) {
+	if (encoder->video_fd >= 0) {
 		close(encoder->video_fd);
 		encoder->video_fd = -1;
 	}
 
-	ret = -1;
+	return ret;
+}
 
-complete:
-	if (enumerate)
-		udev_enumerate_unref(enumerate);
+static void v4l2_encoder_open_init(struct v4l2_encoder *encoder)
+{
+	encoder->media_fd = -1;
+	encoder->video_fd = -1;
+	encoder->source_fd = -1;
+	encoder->bitstream_fd = -1;
 
-	if (udev)
-		udev_unref(udev);
+	clock_gettime(CLOCK_MONOTONIC, &encoder->open_time);
+}
 
-	return ret;
+int v4l2_encoder_open(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	if (!encoder)
+		return -EINVAL;
+
+	v4l2_encoder_open_init(encoder);
+
+	ret = v4l2_encoder_devices_discover(encoder, NULL);
+	if (ret) {
+		fprintf(stderr, "Failed to find encoder devices\n");
+		return ret;
+	}
+
+	return v4l2_encoder_open_complete(encoder);
+}
+
+int v4l2_encoder_open_path(struct v4l2_encoder *encoder,
+			   const char *media_path, const char *video_path)
+{
+	int ret;
+
+	if (!encoder || !media_path)
+		return -EINVAL;
+
+	v4l2_encoder_open_init(encoder);
+
+	if (video_path)
+		ret = v4l2_encoder_devices_open(encoder, media_path,
+						video_path, NULL);
+	else
+		ret = v4l2_encoder_devices_discover(encoder, media_path);
+
+	if (ret) {
+		fprintf(stderr, "Failed to open encoder devices at %s\n",
+			media_path);
+		return ret;
+	}
+
+	return v4l2_encoder_open_complete(encoder);
+}
+
+int v4l2_encoder_open_cached(struct v4l2_encoder *encoder,
+			     const char *cache_path)
+{
+	int ret;
+
+	if (!encoder || !cache_path)
+		return -EINVAL;
+
+	v4l2_encoder_open_init(encoder);
+
+	/* Stale entries fall back to a full discovery that refreshes them. */
+	ret = v4l2_encoder_cache_load(encoder, cache_path);
+	if (ret) {
+		unlink(cache_path);
+
+		ret = v4l2_encoder_devices_discover(encoder, NULL);
+		if (ret) {
+			fprintf(stderr, "Failed to find encoder devices\n");
+			return ret;
+		}
+
+		v4l2_encoder_cache_store(encoder, cache_path);
+	} else {
+		printf("Using cached encoder devices\n");
+	}
+
+	return v4l2_encoder_open_complete(encoder);
 }
 
 void v4l2_encoder_close(struct v4l2_encoder *encoder)
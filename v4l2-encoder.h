@@ -6,11 +6,28 @@
 #ifndef _V4L2_ENCODER_H_
 #define _V4L2_ENCODER_H_
 
+#include <stdatomic.h>
+#include <time.h>
+
+#include <sys/types.h>
+
 #include <linux/videodev2.h>
 
 #include <draw.h>
+#include <rate-control.h>
+#include <analysis.h>
 
 struct v4l2_encoder;
+struct csc_kernel;
+
+enum v4l2_encoder_source {
+	V4L2_ENCODER_SOURCE_PATTERN = 0,
+	V4L2_ENCODER_SOURCE_PATTERN_PNG,
+	V4L2_ENCODER_SOURCE_GRADIENT,
+	V4L2_ENCODER_SOURCE_RECTANGLE,
+	V4L2_ENCODER_SOURCE_MANDELBROT,
+	V4L2_ENCODER_SOURCE_FILE,
+};
 
 struct v4l2_encoder_buffer {
 	struct v4l2_encoder *encoder;
@@ -20,8 +37,121 @@ struct v4l2_encoder_buffer {
 	unsigned int planes_count;
 
 	void *mmap_data[4];
+	/* Owned by the driver, from queueing until dequeued. */
 	bool queued;
 	int request_fd;
+	/* Queued request, to recycle before the buffer is used again. */
+	bool request_queued;
+
+	/* Moving region of the source last written to the buffer. */
+	struct draw_region drawn_region;
+	bool drawn;
+
+	/* Frame cache generation held by the buffer, 0 for none. */
+	unsigned int cache_generation;
+	/* Pre-rendered slot held by the buffer plus one, 0 for none. */
+	unsigned int prerender_slot;
+
+	/* Picture data written by the CPU since the buffer was last queued. */
+	bool cpu_written;
+};
+
+struct v4l2_encoder_controls {
+	struct v4l2_ext_control controls[16];
+	unsigned int count;
+};
+
+/* Parameters applied with the next submitted frame, zero leaves unchanged. */
+struct v4l2_encoder_frame_params {
+	unsigned int qp_i;
+	unsigned int qp_p;
+	unsigned int bitrate;
+	bool key_frame;
+};
+
+/* Frame in flight, keyed by the V4L2 timestamp of its buffers. */
+struct v4l2_encoder_frame {
+	uint64_t v4l2_timestamp;
+	/* Capture time, CLOCK_MONOTONIC in nanoseconds. */
+	uint64_t timestamp;
+	unsigned int frame_number;
+	void *data;
+	bool used;
+
+	/* Coded buffer holding the frame once completed. */
+	unsigned int capture_index;
+	bool completed;
+};
+
+struct v4l2_encoder_format {
+	uint32_t pixelformat;
+
+	/* Frame size range, discrete sizes have equal bounds. */
+	unsigned int width_min;
+	unsigned int width_max;
+	unsigned int width_step;
+	unsigned int height_min;
+	unsigned int height_max;
+	unsigned int height_step;
+};
+
+struct v4l2_encoder_frame_cache {
+	/* Key */
+	unsigned int source;
+	unsigned int width;
+	unsigned int height;
+	uint32_t pixelformat;
+	unsigned int bytesperline;
+
+	void *data[4];
+	unsigned int sizes[4];
+	unsigned int planes_count;
+
+	unsigned int generation;
+	bool valid;
+};
+
+struct v4l2_encoder_prerender {
+	void *data;
+	unsigned int frame_size;
+	unsigned int offsets[4];
+	unsigned int sizes[4];
+	unsigned int planes_count;
+
+	unsigned int count;
+	unsigned int index;
+};
+
+/* Spread of a per-frame duration, in nanoseconds. */
+struct v4l2_encoder_jitter {
+	unsigned int count;
+	uint64_t total;
+	double squares;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct v4l2_encoder_stats {
+	unsigned int frames;
+	uint64_t encode_time;
+	uint64_t output_bytes;
+	uint64_t coded_bytes;
+	unsigned int scene_cuts;
+	unsigned int keyframes_requested;
+	unsigned int skipped;
+	uint64_t first_frame_time;
+	uint64_t start_frame_time;
+	uint64_t warmup_time;
+	unsigned int coded_high_water;
+	unsigned int coded_growths;
+	unsigned int cache_cleans_skipped;
+	struct v4l2_encoder_jitter encode_jitter;
+	struct v4l2_encoder_jitter interval_jitter;
+	struct v4l2_encoder_jitter latency_jitter;
+	unsigned int late;
+	unsigned int dropped;
+	unsigned int slow;
+	unsigned int hangs;
 };
 
 struct v4l2_encoder_setup {
@@ -32,6 +162,18 @@ struct v4l2_encoder_setup {
 	/* Format */
 	uint32_t format;
 
+	/* Source */
+	unsigned int source;
+	const char *source_path;
+	uint32_t source_format;
+
+	/* Benchmark */
+	unsigned int prerender_count;
+
+	/* Draw buffer allocation and sharing between encoders of a thread */
+	unsigned int draw_buffer_flags;
+	bool draw_buffer_shared;
+
 	/* Framerate */
 	unsigned int fps_num;
 	unsigned int fps_den;
@@ -42,12 +184,47 @@ struct v4l2_encoder_setup {
 
 	unsigned int gop_closure;
 	unsigned int gop_size;
+
+	/* Rate control */
+	unsigned int rc_mode;
+	unsigned int bitrate;
+	unsigned int vbv_size;
+
+	/* Content-adaptive quantization */
+	bool adaptive_qp;
+
+	/* Scene-cut detection */
+	bool scene_cut;
+
+	/* Minimum interval between requested keyframes, in milliseconds */
+	unsigned int keyframe_interval;
+
+	/* Duplicate frames */
+	bool skip_duplicates;
+
+	/* Stage CPU accesses to possibly write-combined or uncached buffers */
+	bool staging;
+
+	/* Pre-fault buffers and run a throwaway encode when starting */
+	bool warmup;
+
+	/* Schedule frames at the framerate, dropping missed ones */
+	bool pacing;
+	bool pacing_drop;
 };
 
 struct v4l2_encoder {
 	int video_fd;
 	int media_fd;
 
+	struct timespec open_time;
+	struct timespec start_time;
+	struct timespec complete_time;
+
+	/* Frame schedule slots, counted from the first paced frame. */
+	uint64_t pacing_start;
+	uint64_t pacing_slot;
+
 	char driver[32];
 	char card[32];
 
@@ -61,32 +238,95 @@ struct v4l2_encoder {
 
 	unsigned int output_type;
 	unsigned int output_capabilities;
+	struct v4l2_encoder_format output_formats[16];
+	unsigned int output_formats_count;
 	struct v4l2_format output_format;
 	struct v4l2_encoder_buffer output_buffers[3];
 	unsigned int output_buffers_count;
 	unsigned int output_buffers_index;
+	/* Cache maintenance is left to the per-buffer hints. */
+	bool output_non_coherent;
 
 	unsigned int capture_type;
 	unsigned int capture_capabilities;
 	struct v4l2_format capture_format;
-	struct v4l2_encoder_buffer capture_buffers[3];
+	/* Active coded buffers start at the base, after grown-out ones. */
+	struct v4l2_encoder_buffer capture_buffers[6];
+	unsigned int capture_buffers_base;
 	unsigned int capture_buffers_count;
 	unsigned int capture_buffers_index;
 	unsigned int capture_returned_index;
 
 	unsigned int frame_number;
+	struct v4l2_encoder_frame_params frame_params;
+
+	/* Capture time and metadata attached to the next submitted frame. */
+	uint64_t frame_timestamp;
+	void *frame_data;
+	uint64_t v4l2_timestamp_last;
+	struct v4l2_encoder_frame frames[16];
+	struct v4l2_encoder_frame *frame_returned;
+
+	struct rate_control rate_control;
+	bool rate_control_hardware;
+
+	struct analysis analysis;
+	/* Content-adaptive offset applied on top of the base QP. */
+	int qp_offset;
+
+	/* Set from any thread, consumed when preparing a frame. */
+	atomic_bool keyframe_request;
+	atomic_uint keyframe_requests;
+	uint64_t keyframe_request_time;
+
+	/* Hash of the last submitted picture, to detect duplicates. */
+	uint64_t frame_hash;
+	bool frame_hash_valid;
+	bool frame_skip;
 
 	struct draw_mandelbrot draw_mandelbrot;
 	struct draw_buffer *draw_buffer;
 	unsigned int pattern_step;
 
 	unsigned int x, y;
-	bool pattern_drawn;
 	bool direction;
 
+	struct draw_region rectangle_region;
+	bool background_drawn;
+
+	struct v4l2_encoder_frame_cache frame_cache;
+	struct v4l2_encoder_prerender prerender;
+
+	const struct csc_kernel *csc_kernel;
+	void *source_data;
+	/* Scratch lines for staged writes, kept across frames. */
+	void *staging_data;
+
+	/* Cached copy of coded data when staging. */
+	void *coded_data;
+	unsigned int coded_data_size;
+
+	int source_fd;
+	off_t source_size;
+
+	struct v4l2_encoder_stats stats;
+
 	int bitstream_fd;
 };
 
+void v4l2_encoder_stats_report(struct v4l2_encoder *encoder);
+int v4l2_encoder_frame_qp(struct v4l2_encoder *encoder, unsigned int qp_i,
+			  unsigned int qp_p);
+int v4l2_encoder_frame_bitrate(struct v4l2_encoder *encoder,
+			       unsigned int bitrate);
+int v4l2_encoder_frame_key(struct v4l2_encoder *encoder);
+int v4l2_encoder_frame_timestamp(struct v4l2_encoder *encoder,
+				 uint64_t timestamp);
+int v4l2_encoder_frame_data(struct v4l2_encoder *encoder, void *data);
+struct v4l2_encoder_frame *
+v4l2_encoder_frame_returned(struct v4l2_encoder *encoder);
+int v4l2_encoder_request_keyframe(struct v4l2_encoder *encoder);
+int v4l2_encoder_pace(struct v4l2_encoder *encoder);
 int v4l2_encoder_prepare(struct v4l2_encoder *encoder);
 int v4l2_encoder_complete(struct v4l2_encoder *encoder);
 int v4l2_encoder_run(struct v4l2_encoder *encoder);
@@ -95,20 +335,58 @@ int v4l2_encoder_stop(struct v4l2_encoder *encoder);
 int v4l2_encoder_buffer_setup(struct v4l2_encoder_buffer *buffer,
 			     unsigned int type, unsigned int index);
 int v4l2_encoder_buffer_cleanup(struct v4l2_encoder_buffer *buffer);
+void v4l2_encoder_controls_init(struct v4l2_encoder_controls *controls);
+int v4l2_encoder_controls_add(struct v4l2_encoder_controls *controls,
+			      unsigned int id, int value);
+int v4l2_encoder_controls_commit(struct v4l2_encoder *encoder,
+				 struct v4l2_encoder_controls *controls,
+				 int request_fd);
+int v4l2_encoder_controls_update(struct v4l2_encoder *encoder);
 int v4l2_encoder_setup_defaults(struct v4l2_encoder *encoder);
 int v4l2_encoder_setup_dimensions(struct v4l2_encoder *encoder,
 				  unsigned int width, unsigned int height);
 int v4l2_encoder_setup_format(struct v4l2_encoder *encoder, uint32_t format);
+int v4l2_encoder_setup_source(struct v4l2_encoder *encoder,
+			      unsigned int source);
+int v4l2_encoder_setup_source_path(struct v4l2_encoder *encoder,
+				   const char *path);
+int v4l2_encoder_setup_source_format(struct v4l2_encoder *encoder,
+				     uint32_t format);
+int v4l2_encoder_setup_draw_buffer_shared(struct v4l2_encoder *encoder,
+					  bool shared);
+int v4l2_encoder_setup_draw_buffer_flags(struct v4l2_encoder *encoder,
+					 unsigned int flags);
+int v4l2_encoder_setup_prerender(struct v4l2_encoder *encoder,
+				 unsigned int count);
 int v4l2_encoder_setup_fps(struct v4l2_encoder *encoder, float fps);
 int v4l2_encoder_setup_qp(struct v4l2_encoder *encoder, unsigned int qp_i,
 			  unsigned int qp_p);
 int v4l2_encoder_setup_gop(struct v4l2_encoder *encoder, unsigned int closure,
 			   unsigned int size);
+int v4l2_encoder_setup_bitrate(struct v4l2_encoder *encoder, unsigned int mode,
+			       unsigned int bitrate, unsigned int vbv_size);
+int v4l2_encoder_setup_adaptive_qp(struct v4l2_encoder *encoder, bool enable);
+int v4l2_encoder_setup_scene_cut(struct v4l2_encoder *encoder, bool enable);
+int v4l2_encoder_setup_keyframe_interval(struct v4l2_encoder *encoder,
+					 unsigned int interval);
+int v4l2_encoder_setup_skip_duplicates(struct v4l2_encoder *encoder,
+				       bool enable);
+int v4l2_encoder_setup_staging(struct v4l2_encoder *encoder, bool enable);
+int v4l2_encoder_setup_warmup(struct v4l2_encoder *encoder, bool enable);
+int v4l2_encoder_setup_pacing(struct v4l2_encoder *encoder, bool enable,
+			      bool drop);
 
 int v4l2_encoder_setup(struct v4l2_encoder *encoder);
+int v4l2_encoder_reconfigure(struct v4l2_encoder *encoder, unsigned int width,
+			     unsigned int height, uint32_t format);
+int v4l2_encoder_bench(struct v4l2_encoder *encoder, unsigned int frames);
 int v4l2_encoder_cleanup(struct v4l2_encoder *encoder);
 int v4l2_encoder_probe(struct v4l2_encoder *encoder);
 int v4l2_encoder_open(struct v4l2_encoder *encoder);
+int v4l2_encoder_open_path(struct v4l2_encoder *encoder,
+			   const char *media_path, const char *video_path);
+int v4l2_encoder_open_cached(struct v4l2_encoder *encoder,
+			     const char *cache_path);
 void v4l2_encoder_close(struct v4l2_encoder *encoder);
 
 #endif
@@ -145,6 +145,26 @@ bool v4l2_pixel_format_check(int video_fd, unsigned int type,
 	return false;
 }
 
+int v4l2_frame_size_enum(int video_fd, unsigned int pixel_format,
+			 unsigned int index, struct v4l2_frmsizeenum *frame_size)
+{
+	int ret;
+
+	if (!frame_size)
+		return -EINVAL;
+
+	memset(frame_size, 0, sizeof(*frame_size));
+
+	frame_size->index = index;
+	frame_size->pixel_format = pixel_format;
+
+	ret = ioctl(video_fd, VIDIOC_ENUM_FRAMESIZES, frame_size);
+	if (ret)
+		return -errno;
+
+	return 0;
+}
+
 /* Format */
 
 int v4l2_format_try(int video_fd, struct v4l2_format *format)
@@ -219,6 +239,32 @@ void v4l2_format_setup_pixel(struct v4l2_format *format, unsigned int width,
 	}
 }
 
+int v4l2_format_setup_bytesperline(struct v4l2_format *format,
+				   unsigned int plane_index,
+				   unsigned int bytesperline)
+{
+	bool mplane_check;
+
+	if (!format)
+		return -EINVAL;
+
+	mplane_check = v4l2_type_mplane_check(format->type);
+	if (mplane_check) {
+		if (plane_index >= VIDEO_MAX_PLANES)
+			return -EINVAL;
+
+		format->fmt.pix_mp.plane_fmt[plane_index].bytesperline =
+			bytesperline;
+	} else {
+		if (plane_index > 0)
+			return -EINVAL;
+
+		format->fmt.pix.bytesperline = bytesperline;
+	}
+
+	return 0;
+}
+
 int v4l2_format_setup_sizeimage(struct v4l2_format *format,
 				unsigned int plane_index,
 				unsigned int sizeimage)
@@ -285,12 +331,64 @@ int v4l2_format_pixel_format(struct v4l2_format *format)
 	if (!format)
 		return -EINVAL;
 
+	mplane_check = v4l2_type_mplane_check(format->type);
 	if (mplane_check)
 		return format->fmt.pix_mp.pixelformat;
 	else
 		return format->fmt.pix.pixelformat;
 }
 
+int v4l2_format_bytesperline(struct v4l2_format *format,
+			     unsigned int plane_index,
+			     unsigned int *bytesperline)
+{
+	bool mplane_check;
+
+	if (!format || !bytesperline)
+		return -EINVAL;
+
+	mplane_check = v4l2_type_mplane_check(format->type);
+	if (mplane_check) {
+		if (plane_index >= format->fmt.pix_mp.num_planes)
+			return -EINVAL;
+
+		*bytesperline =
+			format->fmt.pix_mp.plane_fmt[plane_index].bytesperline;
+	} else {
+		if (plane_index > 0)
+			return -EINVAL;
+
+		*bytesperline = format->fmt.pix.bytesperline;
+	}
+
+	return 0;
+}
+
+int v4l2_format_sizeimage(struct v4l2_format *format,
+			  unsigned int plane_index, unsigned int *sizeimage)
+{
+	bool mplane_check;
+
+	if (!format || !sizeimage)
+		return -EINVAL;
+
+	mplane_check = v4l2_type_mplane_check(format->type);
+	if (mplane_check) {
+		if (plane_index >= format->fmt.pix_mp.num_planes)
+			return -EINVAL;
+
+		*sizeimage =
+			format->fmt.pix_mp.plane_fmt[plane_index].sizeimage;
+	} else {
+		if (plane_index > 0)
+			return -EINVAL;
+
+		*sizeimage = format->fmt.pix.sizeimage;
+	}
+
+	return 0;
+}
+
 int v4l2_format_planes_count(struct v4l2_format *format)
 {
 	bool mplane_check;
@@ -416,6 +514,20 @@ int v4l2_control_value(struct v4l2_control *control)
 	return control->value;
 }
 
+int v4l2_control_query(int video_fd, struct v4l2_queryctrl *queryctrl)
+{
+	int ret;
+
+	if (!queryctrl)
+		return -EINVAL;
+
+	ret = ioctl(video_fd, VIDIOC_QUERYCTRL, queryctrl);
+	if (ret)
+		return -errno;
+
+	return 0;
+}
+
 /* Extended Controls */
 
 int v4l2_ext_controls_set(int video_fd, struct v4l2_ext_controls *ext_controls)
@@ -492,6 +604,15 @@ void v4l2_ext_control_setup_base(struct v4l2_ext_control *control,
 	control->id = id;
 }
 
+void v4l2_ext_control_setup_value(struct v4l2_ext_control *control,
+				  int value)
+{
+	if (!control)
+		return;
+
+	control->value = value;
+}
+
 void v4l2_ext_controls_request_attach(struct v4l2_ext_controls *ext_controls,
 				      int request_fd)
 {
@@ -558,6 +679,16 @@ int v4l2_parm_get(int video_fd, struct v4l2_streamparm *streamparm)
 int v4l2_buffers_create(int video_fd, unsigned int type, unsigned int memory,
 			struct v4l2_format *format, unsigned int count,
 			unsigned int *index)
+{
+	return v4l2_buffers_create_flags(video_fd, type, memory, format,
+					 &count, index, NULL);
+}
+
+/* The driver may create fewer buffers than asked, given back in count. */
+int v4l2_buffers_create_flags(int video_fd, unsigned int type,
+			      unsigned int memory, struct v4l2_format *format,
+			      unsigned int *count, unsigned int *index,
+			      unsigned int *flags)
 {
 	struct v4l2_create_buffers create_buffers = { 0 };
 	int ret;
@@ -572,20 +703,36 @@ int v4l2_buffers_create(int video_fd, unsigned int type, unsigned int memory,
 
 	create_buffers.format.type = type;
 	create_buffers.memory = memory;
-	create_buffers.count = count;
+	create_buffers.count = *count;
+
+	if (flags)
+		create_buffers.flags = *flags;
 
 	ret = ioctl(video_fd, VIDIOC_CREATE_BUFS, &create_buffers);
 	if (ret)
 		return -errno;
 
+	*count = create_buffers.count;
+
 	if (index)
 		*index = create_buffers.index;
 
+	if (flags)
+		*flags = create_buffers.flags;
+
 	return 0;
 }
 
 int v4l2_buffers_request(int video_fd, unsigned int type, unsigned int memory,
 			 unsigned int count)
+{
+	return v4l2_buffers_request_flags(video_fd, type, memory, count, NULL);
+}
+
+/* Flags the kernel does not support are cleared on return. */
+int v4l2_buffers_request_flags(int video_fd, unsigned int type,
+			       unsigned int memory, unsigned int count,
+			       unsigned int *flags)
 {
 	struct v4l2_requestbuffers requestbuffers = { 0 };
 	int ret;
@@ -594,10 +741,16 @@ int v4l2_buffers_request(int video_fd, unsigned int type, unsigned int memory,
 	requestbuffers.memory = memory;
 	requestbuffers.count = count;
 
+	if (flags)
+		requestbuffers.flags = *flags;
+
 	ret = ioctl(video_fd, VIDIOC_REQBUFS, &requestbuffers);
 	if (ret)
 		return -errno;
 
+	if (flags)
+		*flags = requestbuffers.flags;
+
 	return 0;
 }
 
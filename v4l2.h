@@ -40,6 +40,8 @@ int v4l2_pixel_format_enum(int video_fd, unsigned int type, unsigned int index,
 			   unsigned int *pixel_format, char *description);
 bool v4l2_pixel_format_check(int video_fd, unsigned int type,
 			     unsigned int pixel_format);
+int v4l2_frame_size_enum(int video_fd, unsigned int pixel_format,
+			 unsigned int index, struct v4l2_frmsizeenum *frame_size);
 
 /* Format */
 
@@ -49,12 +51,20 @@ int v4l2_format_get(int video_fd, struct v4l2_format *format);
 void v4l2_format_setup_base(struct v4l2_format *format, unsigned int type);
 void v4l2_format_setup_pixel(struct v4l2_format *format, unsigned int width,
 			     unsigned int height, unsigned int pixel_format);
+int v4l2_format_setup_bytesperline(struct v4l2_format *format,
+				   unsigned int plane_index,
+				   unsigned int bytesperline);
 int v4l2_format_setup_sizeimage(struct v4l2_format *format,
 				unsigned int plane_index,
 				unsigned int sizeimage);
 int v4l2_format_pixel(struct v4l2_format *format, unsigned int *width,
 		      unsigned int *height, unsigned int *pixel_format);
 int v4l2_format_pixel_format(struct v4l2_format *format);
+int v4l2_format_bytesperline(struct v4l2_format *format,
+			     unsigned int plane_index,
+			     unsigned int *bytesperline);
+int v4l2_format_sizeimage(struct v4l2_format *format,
+			  unsigned int plane_index, unsigned int *sizeimage);
 int v4l2_format_planes_count(struct v4l2_format *format);
 
 /* Selection */
@@ -74,6 +84,7 @@ int v4l2_control_get(int video_fd, struct v4l2_control *control);
 void v4l2_control_setup_base(struct v4l2_control *control, unsigned int id);
 void v4l2_control_setup_value(struct v4l2_control *control, int value);
 int v4l2_control_value(struct v4l2_control *control);
+int v4l2_control_query(int video_fd, struct v4l2_queryctrl *queryctrl);
 
 /* Extended Controls */
 
@@ -84,6 +95,8 @@ void v4l2_ext_control_setup_compound(struct v4l2_ext_control *control,
 				     void *data, unsigned int size);
 void v4l2_ext_control_setup_base(struct v4l2_ext_control *control,
 				 unsigned int id);
+void v4l2_ext_control_setup_value(struct v4l2_ext_control *control,
+				  int value);
 void v4l2_ext_controls_setup(struct v4l2_ext_controls *ext_controls,
 			     struct v4l2_ext_control *controls,
 			     unsigned int controls_count);
@@ -103,8 +116,15 @@ void v4l2_parm_setup_base(struct v4l2_streamparm *streamparm,
 int v4l2_buffers_create(int video_fd, unsigned int type, unsigned int memory,
 			struct v4l2_format *format, unsigned int count,
 			unsigned int *index);
+int v4l2_buffers_create_flags(int video_fd, unsigned int type,
+			      unsigned int memory, struct v4l2_format *format,
+			      unsigned int *count, unsigned int *index,
+			      unsigned int *flags);
 int v4l2_buffers_request(int video_fd, unsigned int type, unsigned int memory,
 			 unsigned int count);
+int v4l2_buffers_request_flags(int video_fd, unsigned int type,
+			       unsigned int memory, unsigned int count,
+			       unsigned int *flags);
 int v4l2_buffers_destroy(int video_fd, unsigned int type, unsigned int memory);
 int v4l2_buffers_capabilities_probe(int video_fd, unsigned int type,
 				    unsigned int memory,